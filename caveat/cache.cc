@@ -4,6 +4,8 @@
 #include <string.h>
 #include <sys/syscall.h>
 
+#include "options.h"
+#include "uspike.h"
 #include "cache.h"
 #include "lru_fsm_1way.h"
 #include "lru_fsm_2way.h"
@@ -33,8 +35,8 @@ cache_t::cache_t(const char* nam, int miss, int w, int lin, int row, bool writea
   row_mask =  (rows-1);
   tags = new tag_t*[ways];
   for (int k=0; k<ways; k++)
-    tags[k] = new tag_t[rows];
-  states = new unsigned short[rows];
+    tags[k] = (tag_t*)page_alloc(rows*sizeof(tag_t)); // for place()
+  states = (unsigned short*)page_alloc(rows*sizeof(unsigned short));
   flush();
   static long place =0;
   evicted = writeable ? &place : 0;
@@ -50,6 +52,13 @@ void cache_t::flush()
   memset((char*)states, 0, rows*sizeof(unsigned short));
 }
 
+void cache_t::place(int node)
+{
+  for (int k=0; k<ways; k++)
+    numa_move(tags[k], rows*sizeof(tag_t), node);
+  numa_move(states, rows*sizeof(unsigned short), node);
+}
+
 void cache_t::show()
 {
   fprintf(stderr, "lg_line=%ld lg_rows=%ld line=%ld rows=%ld ways=%ld row_mask=0x%lx\n",
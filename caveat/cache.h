@@ -42,6 +42,8 @@ class cache_t {		        // cache descriptor
   long penalty() { return _penalty; }
   
   void flush();
+  void reset() { _refs=_misses=_updates=_evictions=0; } // counters only
+  void place(int node);		// move arrays to NUMA node
   void show();
   void print(FILE* f =stderr);
 };
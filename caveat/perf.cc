@@ -18,19 +18,30 @@ perf_t::perf_t(long n)
   if (n >= h->_cores)
     fprintf(stderr, "perf_t(%ld) greater than allocated cores=%ld\n", n, h->_cores);
   else {
-    volatile char* ptr = h->arrays + n*h->parcels*(sizeof(count_t)+2*sizeof(long));
+    volatile char* ptr = h->arrays + n*h->stride;
     _count = (volatile count_t*)ptr;
     _imiss = (volatile long*)(ptr + h->parcels*sizeof(count_t));
     _dmiss = (volatile long*)(_imiss + h->parcels);
   }
 }
 
+void perf_t::reset()
+{
+  memset((void*)_count, 0, h->parcels*(sizeof(count_t)+2*sizeof(long)));
+}
+
+void perf_t::place(int node)
+{
+  numa_move(_count, h->parcels*(sizeof(count_t)+2*sizeof(long)), node);
+}
+
 void perf_t::create(long base, long bound, long n, const char* shm_name)
 {
-  long sz = sizeof(perf_header_t);
   long p = (bound-base)/2;
-  sz += p*n*sizeof(count_t);	// execution counters
-  sz += 2*p*n*sizeof(long);	// cache miss counters
+  long stride = p*sizeof(count_t);	// execution counters
+  stride += 2*p*sizeof(long);		// cache miss counters
+  stride = (stride+4095) & ~4095L;
+  long sz = sizeof(perf_header_t) + n*stride;
   int fd = shm_open(shm_name, O_CREAT|O_TRUNC|O_RDWR, S_IRWXU);
   dieif(fd<0, "shm_open() failed");
   dieif(ftruncate(fd, sz)<0, "ftruncate() failed");
@@ -41,6 +52,7 @@ void perf_t::create(long base, long bound, long n, const char* shm_name)
   h->base = base;
   h->parcels = p;
   h->_cores = n;
+  h->stride = stride;
 }
 
 void perf_t::open(const char* shm_name)
@@ -7,7 +7,8 @@ struct perf_header_t {		// performance segment header
   long parcels;			// length of text segment (2B parcels)
   long base;			// address of code segment
   long _cores;			// number of simulated cores allocated
-  volatile char arrays[0];	// beginning of dynamic arrays
+  long stride;			// bytes of arrays per core, whole pages for place()
+  alignas(4096) volatile char arrays[0]; // beginning of dynamic arrays
 };
 
 struct count_t {		// perinstruction counters
@@ -23,6 +24,8 @@ class perf_t {			// pointers into shared memory structure
   long index(long pc) { checkif(h->base<=pc && (pc-h->base)/2<h->parcels); return (pc - h->base) / 2; }
 public:
   perf_t(long n);		// initialize as core n
+  void place(int node);		// move this core's counters to NUMA node
+  void reset();			// zero this core's counters
   static void create(long base, long bound, long n, const char* shm_name);
   static void open(const char* shm_name);
   static void close(const char* shm_name);
@@ -0,0 +1,24 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+/*
+  Region of interest markers for guest programs.  Each is the hint
+  slti x0,x0,N which does nothing on hardware, in uspike, or in caveat
+  without --roi, except that resets and snapshots always work.  With
+  --roi caveat simulates only between BEGIN and END in detail, per
+  hart, and new threads inherit the state of their parent.
+*/
+
+#define ROI_BEGIN	1	/* start detailed simulation */
+#define ROI_END		2	/* back to fast functional simulation */
+#define ROI_RESET	3	/* zero cache, IPC and perf counters */
+#define ROI_SNAPSHOT	4	/* print counters so far to stderr */
+
+#ifdef __riscv
+#define ROI_MARKER(n)	__asm__ volatile ("slti x0, x0, %0" : : "i"(n) : "memory")
+#define roi_begin()	ROI_MARKER(ROI_BEGIN)
+#define roi_end()	ROI_MARKER(ROI_END)
+#define roi_reset()	ROI_MARKER(ROI_RESET)
+#define roi_snapshot()	ROI_MARKER(ROI_SNAPSHOT)
+#endif
@@ -1,8 +1,14 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <sched.h>
 #include <signal.h>
 #include <limits.h>
+#include <math.h>
+#include <xmmintrin.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <sys/syscall.h>
 #include <linux/futex.h>
 
@@ -13,6 +19,10 @@
 #include "hart.h"
 #include "cache.h"
 #include "perf.h"
+#include "roi.h"
+#include "trace.h"
+#include "stackdist.h"
+#include "arena.h"
 
 using namespace std;
 void* operator new(size_t size);
@@ -32,19 +42,90 @@ option<int> conf_Drows("drows",	6,		"Data cache log-base-2 number of rows");
 option<int> conf_cores("cores",	8,		"Maximum number of cores");
 
 option<>    conf_perf( "perf",	"caveat",	"Name of shared memory segment");
+option<>    conf_simpoints("simpoints", 0,	"Simulate only intervals chosen by simpoint script");
+
+option<long> conf_smarts("smarts", 0,	"SMARTS sampling period in instructions, 0=off");
+option<long> conf_window("window", 1000,	"SMARTS measurement window in instructions");
+option<long> conf_settle("settle", 2000,	"SMARTS detailed instructions before each window");
+option<int> conf_confidence("confidence", 0,	"SMARTS stops when CPI known to +/- percent, 0=run to end");
+option<bool> conf_roi("roi",	false, true,	"Simulate in detail only between roi.h markers");
+option<long> conf_skip("skip",	0,		"Fast forward first N instructions of each hart");
+option<bool> conf_warm("warm",	false, true,	"Warm caches while fast forwarding");
+option<>    conf_replay("replay", 0, "uspike.trc",	"Simulate caches from --trace file instead of running program");
+option<>    conf_configs("configs", 0,	"File of configurations to simulate, one per line");
+option<int> conf_jobs("jobs",	0,		"Simulations of --configs run at once, 0=host CPUs");
+extern option<> conf_trace;
+extern option<> conf_mrc;
+
+// Cache and pipeline parameters, from options or a --configs line
+struct config_t {
+  long imiss, iways, iline, irows;
+  long dmiss, dways, dline, drows;
+  long jump;
+  config_t();
+  const char* parse(const char* line); // returns unknown option or 0
+};
+
+static config_t* machine;	// of this --configs child, else options
+
+config_t::config_t()
+{
+  imiss=conf_Imiss;  iways=conf_Iways;  iline=conf_Iline;  irows=conf_Irows;
+  dmiss=conf_Dmiss;  dways=conf_Dways;  dline=conf_Dline;  drows=conf_Drows;
+  jump=conf_Jump;
+}
+
+// Line is options as on the command line, e.g. --dways=2 --drows=7
+const char* config_t::parse(const char* line)
+{
+  static const struct { const char* name; long config_t::*field; } table[] = {
+    { "imiss", &config_t::imiss }, { "iways", &config_t::iways },
+    { "iline", &config_t::iline }, { "irows", &config_t::irows },
+    { "dmiss", &config_t::dmiss }, { "dways", &config_t::dways },
+    { "dline", &config_t::dline }, { "drows", &config_t::drows },
+    { "jump",  &config_t::jump  },
+  };
+  static char word[256];
+  for (int n; sscanf(line, " %255s%n", word, &n) == 1; line += n) {
+    char* eq = strchr(word, '=');
+    if (strncmp(word, "--", 2) != 0 || !eq)
+      return word;
+    *eq = 0;
+    unsigned k = 0;
+    while (k < sizeof table/sizeof table[0] && strcmp(word+2, table[k].name) != 0)
+      k++;
+    if (k == sizeof table/sizeof table[0])
+      return word;
+    this->*table[k].field = atol(eq+1);
+  }
+  return 0;
+}
+
+enum { mode_fast, mode_warm, mode_detail };
 
 class mem_t : public mmu_t, public perf_t {
 public:
   long local_time;
-  mem_t(long n);
+  int mode;			// mode_fast=no model, mode_warm=caches only
+  long local_insns;		// simulated in detail since counters reset
+  long reset_time;		// local_time when counters reset
+  long skip_until;		// executed() when detailed simulation starts
+  long jump;			// taken branch cycles
+  tracer_t* tracer;		// if --trace, in every mode
+  mem_t(long n, const config_t& c =config_t());
   void insn_model(long pc);
   long jump_model(long npc, long pc);
-  long load_model( long a,  long pc);
-  long store_model(long a,  long pc);
-  void amo_model(  long a,  long pc);
+  long load_model( long a,  long pc, int size);
+  long store_model(long a,  long pc, int size);
+  void amo_model(  long a,  long pc, int size);
+  void roi_model(long what, long pc);
+  void reset_counters();
+  cache_t* icache() { return &ic; }
   cache_t* dcache() { return &dc; }
   long clock() { return local_time; }
+  double ipc() { return local_time>reset_time ? (double)local_insns/(local_time-reset_time) : 0; }
   void print();
+  void place(int node);
 private:
   cache_t ic;
   cache_t dc;
@@ -52,6 +133,13 @@ private:
 
 inline void mem_t::insn_model(long pc)
 {
+  if (tracer)
+    tracer->insn(pc);
+  if (mode != mode_detail) {
+    if (mode == mode_warm)
+      ic.lookup(pc);
+    return;
+  }
   if (!ic.lookup(pc)) {
     local_time += ic.penalty();
     inc_imiss(pc);
@@ -60,17 +148,27 @@ inline void mem_t::insn_model(long pc)
   inc_count(pc);
   inc_cycle(pc);
   local_time += 1;
+  local_insns += 1;
 }
 
 inline long mem_t::jump_model(long npc, long pc)
 {
-  local_time += conf_Jump;
-  inc_cycle(npc, conf_Jump);
+  if (mode != mode_detail)
+    return npc;
+  local_time += jump;
+  inc_cycle(npc, jump);
   return npc;
 }
 
-inline long mem_t::load_model(long a, long pc)
+inline long mem_t::load_model(long a, long pc, int size)
 {
+  if (tracer)
+    tracer->ref(trace_load, a, size);
+  if (mode != mode_detail) {
+    if (mode == mode_warm)
+      dc.lookup(a);
+    return a;
+  }
   if (!dc.lookup(a)) {
     inc_dmiss(pc);
     local_time += dc.penalty();
@@ -79,8 +177,15 @@ inline long mem_t::load_model(long a, long pc)
   return a;
 }
 
-inline long mem_t::store_model(long a, long pc)
+inline long mem_t::store_model(long a, long pc, int size)
 {
+  if (tracer)
+    tracer->ref(trace_store, a, size);
+  if (mode != mode_detail) {
+    if (mode == mode_warm)
+      dc.lookup(a, true);
+    return a;
+  }
   if (!dc.lookup(a, true)) {
     inc_dmiss(pc);
     local_time += dc.penalty();
@@ -89,8 +194,15 @@ inline long mem_t::store_model(long a, long pc)
   return a;
 }
 
-inline void mem_t::amo_model(long a, long pc)
+inline void mem_t::amo_model(long a, long pc, int size)
 {
+  if (tracer)
+    tracer->ref(trace_amo, a, size);
+  if (mode != mode_detail) {
+    if (mode == mode_warm)
+      dc.lookup(a, true);
+    return;
+  }
   if (!dc.lookup(a, true)) {
     inc_dmiss(pc);
     local_time += dc.penalty();
@@ -105,10 +217,13 @@ public:
   core_t(core_t* p);
   core_t* newcore() { return new core_t(this); }
   void proxy_syscall(long sysnum);
+  void place(int node);
+  bool interpreter(long how_many);
   
   static core_t* list() { return (core_t*)hart_t::list(); }
   core_t* next() { return (core_t*)hart_t::next(); }
   mem_t* mem() { return static_cast<mem_t*>(this); }
+  cache_t* icache() { return mem()->icache(); }
   cache_t* dcache() { return mem()->dcache(); }
 
   long system_clock() { return global_time; }
@@ -118,13 +233,78 @@ public:
 
 volatile long core_t::global_time;
 
-mem_t::mem_t(long n)
+#include "spike_link.h"
+#include "interpreter.h"
+
+// Detailed simulation starts after --skip instructions, with the
+// cache tags but not counters from warming (if --warm).
+bool core_t::interpreter(long how_many)
+{
+  if (executed() < skip_until) {
+    long left = skip_until - executed();
+    bool stopped = hart_t::interpreter<mem_t>(how_many < left ? how_many : left);
+    if (executed() < skip_until || stopped || suspended())
+      return stopped;
+    mode = mode_detail;
+    reset_counters();
+    how_many -= left;
+    if (how_many <= 0)
+      return false;
+  }
+  return hart_t::interpreter<mem_t>(how_many);
+}
+
+mem_t::mem_t(long n, const config_t& c)
   : perf_t(n),
-    ic("Instruction", conf_Imiss, conf_Iways, conf_Iline, conf_Irows, false),
-    dc("Data",        conf_Dmiss, conf_Dways, conf_Dline, conf_Drows, true)
+    ic("Instruction", c.imiss, c.iways, c.iline, c.irows, false),
+    dc("Data",        c.dmiss, c.dways, c.dline, c.drows, true)
 		 
 {
+  jump = c.jump;
   local_time = 0;
+  mode = mode_detail;
+  local_insns = 0;
+  reset_time = 0;
+  skip_until = 0;
+  tracer = 0;
+}
+
+void mem_t::reset_counters()
+{
+  ic.reset();
+  dc.reset();
+  perf_t::reset();
+  local_insns = 0;
+  reset_time = local_time;
+}
+
+void mem_t::roi_model(long what, long pc)
+{
+  switch (what) {
+  case ROI_BEGIN:
+    if (conf_roi)
+      mode = mode_detail;
+    break;
+  case ROI_END:
+    if (conf_roi)
+      mode = mode_fast;
+    break;
+  case ROI_RESET:
+    reset_counters();
+    break;
+  case ROI_SNAPSHOT:
+    {
+      // guest threads share no stdio lock, so one write() per line;
+      // host FP here must not leak into guest fflags through MXCSR
+      unsigned csr = _mm_getcsr();
+      char buf[256];
+      int n = snprintf(buf, sizeof buf, "\nROI snapshot at %lx: %ld insns IPC %.3f, I$ %ld refs %ld misses, D$ %ld refs %ld misses\n",
+		       pc, local_insns, ipc(), ic.refs(), ic.misses(), dc.refs(), dc.misses());
+      write(2, buf, n);
+      _mm_setcsr(csr);
+    }
+    break;
+  }
 }
 
 void mem_t::print()
@@ -133,13 +313,40 @@ void mem_t::print()
   dc.print();
 }
 
-core_t::core_t() : hart_t(mem()), mem_t(number())
+void mem_t::place(int node)
 {
+  ic.place(node);
+  dc.place(node);
+  perf_t::place(node);
+}
+
+// mem_t is constructed before hart_t has a number
+core_t::core_t() : hart_t(mem()), mem_t(number(), machine ? *machine : config_t())
+{
+  if (conf_trace)
+    tracer = new tracer_t(number());
+  if (conf_skip > 0) {
+    skip_until = conf_skip;
+    mode = conf_warm ? mode_warm : mode_fast;
+  }
 }
 
-core_t::core_t(core_t* p) : hart_t(p, mem()), mem_t(number())
+core_t::core_t(core_t* p) : hart_t(p, mem()), mem_t(number(), machine ? *machine : config_t())
 {
+  if (conf_trace)
+    tracer = new tracer_t(number());
   local_time = p->local_time;
+  reset_time = p->local_time;
+  mode = p->mode;
+  if (p->executed() < p->skip_until)
+    skip_until = conf_skip;	// new thread skips its own first instructions
+}
+
+void core_t::place(int node)
+{
+  hart_t::place(node);
+  mem_t::place(node);
+  numa_move(this, sizeof(core_t), node);
 }
 
 
@@ -159,6 +366,8 @@ void core_t::proxy_syscall(long sysnum)
   }
   local_time = LONG_MAX;
   */
+  if (tracer && (sysnum == SYS_exit || sysnum == SYS_exit_group))
+    tracer->flush();		// only this thread may flush its buffer
   hart_t::proxy_syscall(sysnum);
   /*
   global_time += SYSCALL_OVERHEAD;
@@ -180,7 +389,33 @@ void core_t::update_time()
 }
 
 
+// Summary of one configuration's simulation
+struct result_t {
+  bool done;			// false if simulation failed
+  long insns, cycles;		// cycles of slowest core
+  long irefs, imisses;
+  long drefs, dmisses;
+  long skipped;			// trace records not simulated
+  void add(mem_t* m);
+};
+
+void result_t::add(mem_t* m)
+{
+  done = true;
+  insns += m->local_insns;
+  if (m->clock() > cycles)
+    cycles = m->clock();
+  irefs   += m->icache()->refs();
+  imisses += m->icache()->misses();
+  drefs   += m->dcache()->refs();
+  dmisses += m->dcache()->misses();
+}
+
+static result_t* sweep_result;	// of this --configs child, shared with parent
+
 void start_time();
+void smarts_report();
+
 double elapse_time();
 void status_report();
 
@@ -192,8 +427,15 @@ void exitfunc()
     p->mem()->print();
   }
   fprintf(stderr, "\n");
+  if (conf_smarts)
+    smarts_report();
   status_report();
   fprintf(stderr, "\n");
+  if (conf_mstats)
+    malloc_stats();
+  if (sweep_result)
+    for (core_t* p=core_t::list(); p; p=p->next())
+      sweep_result->add(p->mem());
 }
 
 #ifdef DEBUG
@@ -212,6 +454,336 @@ void signal_handler(int nSIGnum)
 }
 #endif
 
+// Run exactly n more instructions of a single-threaded program
+static void run_exactly(core_t* cpu, long n)
+{
+  long end = cpu->executed() + n;
+  while (cpu->executed() < end) {
+    cpu->interpreter(end - cpu->executed());
+    dieif(hart_t::threads() > 1, "Sampling needs a single-threaded program");
+  }
+}
+
+/*
+  With --simpoints only the listed intervals of hart 0 are simulated in
+  detail, fast forwarding functionally between them.  Whole program
+  results are the averages of the intervals' results weighted by the
+  fraction of the program each represents.  Caches are cold at the
+  start of each interval.
+*/
+void run_simpoints(core_t* cpu)
+{
+  dieif(conf_workers, "--simpoints needs a single-threaded program, not --workers");
+  FILE* f = fopen(conf_simpoints, "r");
+  dieif(!f, "Cannot open %s", (const char*)conf_simpoints);
+  long interval = 0;
+  dieif(fscanf(f, " # interval %ld", &interval) != 1 || interval <= 0, "%s is not simpoint output", (const char*)conf_simpoints);
+  double cpi=0, imr=0, dmr=0, total=0;
+  int points = 0;
+  long index;
+  double weight;
+  while (fscanf(f, "%ld %lf", &index, &weight) == 2) {
+    long start = index*interval;
+    dieif(start < cpu->executed(), "Simulation points in %s not in order", (const char*)conf_simpoints);
+    cpu->mode = mode_fast;
+    run_exactly(cpu, start - cpu->executed());
+    cpu->icache()->flush();
+    cpu->dcache()->flush();
+    cpu->mode = mode_detail;
+    long cycles = cpu->local_clock();
+    long iref=cpu->icache()->refs(), imiss=cpu->icache()->misses();
+    long dref=cpu->dcache()->refs(), dmiss=cpu->dcache()->misses();
+    run_exactly(cpu, interval);
+    cycles = cpu->local_clock() - cycles;
+    iref  = cpu->icache()->refs() - iref;
+    imiss = cpu->icache()->misses() - imiss;
+    dref  = cpu->dcache()->refs() - dref;
+    dmiss = cpu->dcache()->misses() - dmiss;
+    fprintf(stderr, "\rInterval %ld weight %.4f CPI %.3f I$ %.4f D$ %.4f\n", index, weight,
+	    (double)cycles/interval, iref ? (double)imiss/iref : 0.0, dref ? (double)dmiss/dref : 0.0);
+    cpi += weight * cycles/interval;
+    if (iref)  imr += weight * imiss/iref;
+    if (dref)  dmr += weight * dmiss/dref;
+    total += weight;
+    points++;
+  }
+  fclose(f);
+  dieif(points == 0 || total <= 0, "No simulation points in %s", (const char*)conf_simpoints);
+  fprintf(stderr, "\n%d simulation points of %ld instructions, weights sum to %.4f\n", points, interval, total);
+  fprintf(stderr, "Estimated CPI %.3f, I$ miss rate %.4f, D$ miss rate %.4f\n", cpi/total, imr/total, dmr/total);
+  exit(0);
+}
+
+/*
+  SMARTS systematic sampling: in every --smarts period of instructions
+  the caches are warmed functionally, then --settle instructions are
+  simulated in detail before a --window whose CPI is measured.  The
+  estimate is the mean of the windows' CPI, with a 99.7% confidence
+  interval of 3 standard errors.
+*/
+static long smarts_n;
+static double smarts_sum, smarts_sumsq;
+
+static double smarts_mean()
+{
+  return smarts_sum/smarts_n;
+}
+
+static double smarts_error()	// 99.7% confidence half-width
+{
+  if (smarts_n < 2)
+    return 0;
+  double var = (smarts_sumsq - smarts_sum*smarts_sum/smarts_n) / (smarts_n-1);
+  return 3*sqrt((var > 0 ? var : 0)/smarts_n);
+}
+
+void smarts_report()
+{
+  if (smarts_n == 0) {
+    fprintf(stderr, "No SMARTS samples, program shorter than --smarts=%ld\n", (long)conf_smarts);
+    return;
+  }
+  fprintf(stderr, "%ld SMARTS samples of %ld instructions\n", smarts_n, (long)conf_window);
+  fprintf(stderr, "Estimated CPI %.3f +/- %.3f (99.7%% confidence), IPC %.3f\n",
+	  smarts_mean(), smarts_error(), 1/smarts_mean());
+}
+
+void run_smarts(core_t* cpu)
+{
+  dieif(conf_workers, "--smarts needs a single-threaded program, not --workers");
+  dieif(conf_window <= 0 || conf_settle < 0, "--window and --settle must be positive");
+  long warm = conf_smarts - conf_settle - conf_window;
+  dieif(warm < 0, "--smarts=%ld shorter than --settle plus --window", (long)conf_smarts);
+  while (1) {
+    cpu->mode = mode_warm;
+    run_exactly(cpu, warm);
+    cpu->mode = mode_detail;
+    run_exactly(cpu, conf_settle);
+    long cycles = cpu->local_clock();
+    run_exactly(cpu, conf_window);
+    double cpi = (double)(cpu->local_clock() - cycles) / conf_window;
+    smarts_n++;
+    smarts_sum += cpi;
+    smarts_sumsq += cpi*cpi;
+    fprintf(stderr, "\r\33[2K%12ld insns %ld samples CPI %.3f +/- %.3f", cpu->executed(), smarts_n, smarts_mean(), smarts_error());
+    if (conf_confidence && smarts_n >= 30 && smarts_error() <= smarts_mean()*conf_confidence/100) {
+      fprintf(stderr, "\nConfidence reached, stopping\n");
+      exit(0);
+    }
+  }
+}
+
+static void print_results(result_t* r, char** label, int n)
+{
+  fprintf(stderr, "%12s %12s %6s %8s %8s  %s\n", "insns", "cycles", "IPC", "I$ miss", "D$ miss", "configuration");
+  for (int k=0; k<n; k++) {
+    if (!r[k].done)
+      fprintf(stderr, "%12s %12s %6s %8s %8s  %s\n", "failed", "-", "-", "-", "-", label[k]);
+    else
+      fprintf(stderr, "%12ld %12ld %6.3f %8.4f %8.4f  %s\n", r[k].insns, r[k].cycles,
+	      r[k].cycles ? (double)r[k].insns/r[k].cycles : 0.0,
+	      r[k].irefs ? (double)r[k].imisses/r[k].irefs : 0.0,
+	      r[k].drefs ? (double)r[k].dmisses/r[k].drefs : 0.0, label[k]);
+    if (r[k].skipped)
+      fprintf(stderr, "%12ld records skipped, not of this program or beyond --cores\n", r[k].skipped);
+  }
+}
+
+// Lines of --configs file, or just the command line options
+static int read_configs(config_t** configs, char*** labels)
+{
+  if (!conf_configs) {
+    *configs = new config_t[1];
+    *labels = new char*[1];
+    (*labels)[0] = (char*)"command line";
+    return 1;
+  }
+  FILE* f = fopen(conf_configs, "r");
+  dieif(!f, "Cannot open %s", (const char*)conf_configs);
+  char line[1024];
+  int lines = 0;
+  while (fgets(line, sizeof line, f))
+    lines++;
+  *configs = new config_t[lines];
+  *labels = new char*[lines];
+  rewind(f);
+  int n = 0;
+  while (fgets(line, sizeof line, f)) {
+    line[strcspn(line, "\n")] = 0;
+    char first = line[strspn(line, " \t")];
+    if (first == 0 || first == '#')
+      continue;
+    const char* bad = (*configs)[n].parse(line);
+    dieif(bad, "Unknown configuration %s in %s", bad, (const char*)conf_configs);
+    (*labels)[n++] = strdup(line);
+  }
+  fclose(f);
+  dieif(n == 0, "No configurations in %s", (const char*)conf_configs);
+  return n;
+}
+
+/*
+  --replay simulates the caches and pipeline timing of a --trace file
+  without running the program, which is loaded only for its text
+  segment.  A taken jump is inferred when an instruction does not
+  follow its predecessor.  Both halves of a fused pair are traced, so
+  the encoded length is the fall through, but a cas substituted for
+  lr/sc is one record, so its predecoded length is too.  A jump to
+  the next instruction cannot be seen.  Every line of a --configs file is replayed
+  by its own host thread over the same mapped trace, configuration k
+  counting in perf cores k*--cores and up.
+*/
+#define REPLAY_STACK_SIZE  (1<<16)
+
+struct replay_t {
+  mem_t** core;			// [conf_cores]
+  long* last_pc;		// [conf_cores] previous instruction
+  long skipped;			// records not of this program
+};
+
+static const void* replay_trace;
+static long replay_bytes;
+static volatile int replay_running;
+
+static int replay_thread(void* arg)
+{
+  replay_t* r = (replay_t*)arg;
+  trace_reader_t t(replay_trace, replay_bytes);
+  trace_rec_t rec;
+  while (t.next(rec)) {
+    long pc;
+    if (rec.core >= conf_cores || (rec.kind == trace_insn && !code.valid(rec.addr))) {
+      r->skipped++;
+      continue;
+    }
+    mem_t* m = r->core[rec.core];
+    long& last = r->last_pc[rec.core];
+    switch (rec.kind) {
+    case trace_insn:
+      pc = rec.addr;
+      if (last && pc != last+((code.image(last)&3)==3 ? 4 : 2) && pc != last+op_length[code.at(last).opcode()])
+	m->mem_t::jump_model(pc, last);
+      m->mem_t::insn_model(pc);
+      last = pc;
+      break;
+    case trace_load:   if (last) m->mem_t::load_model( rec.addr, last, rec.size);  break;
+    case trace_store:  if (last) m->mem_t::store_model(rec.addr, last, rec.size);  break;
+    case trace_amo:    if (last) m->mem_t::amo_model(  rec.addr, last, rec.size);  break;
+    }
+  }
+  __sync_fetch_and_add(&replay_running, -1);
+  futex((int*)&replay_running, FUTEX_WAKE, 1);
+  return 0;
+}
+
+void run_replay()
+{
+  replay_trace = trace_map(conf_replay, &replay_bytes);
+  dieif(!replay_trace, "Cannot read %s", (const char*)conf_replay);
+  dieif(!trace_reader_t(replay_trace, replay_bytes).valid(), "%s is not a trace file", (const char*)conf_replay);
+  if (conf_mrc) {
+    dieif(conf_configs, "--mrc and --configs are exclusive");
+    miss_ratio_curves(replay_trace, replay_bytes);
+    fprintf(stderr, "\nReplayed %s in %3.1fs\n", (const char*)conf_replay, elapse_time());
+    exit(0);
+  }
+  config_t* configs;
+  char** labels;
+  int n = read_configs(&configs, &labels);
+  perf_t::create(code.base(), code.limit(), n*conf_cores, conf_perf);
+  replay_t* r = new replay_t[n];
+  for (int k=0; k<n; k++) {
+    r[k].core = new mem_t*[conf_cores];
+    for (int c=0; c<conf_cores; c++)
+      r[k].core[c] = new mem_t(k*conf_cores+c, configs[k]);
+    r[k].last_pc = new long[conf_cores]();
+    r[k].skipped = 0;
+  }
+  code.predecode_all();		// threads below only read it
+  if (n == 1) {
+    replay_running = 1;
+    replay_thread(&r[0]);
+  }
+  else {
+    // clone()d like guest threads (see spinlock_t in uspike.h)
+    replay_running = n;
+    long flags = CLONE_VM|CLONE_FS|CLONE_FILES|CLONE_SIGHAND|CLONE_THREAD|CLONE_SYSVSEM;
+    for (int k=0; k<n; k++) {
+      char* stack = new char[REPLAY_STACK_SIZE];
+      dieif(clone(replay_thread, stack+REPLAY_STACK_SIZE, flags, &r[k]) < 0, "Cannot create replay thread");
+    }
+    int left;
+    while ((left=replay_running) > 0)
+      futex((int*)&replay_running, FUTEX_WAIT, left);
+  }
+  if (n == 1)
+    for (int c=0; c<conf_cores; c++)
+      if (r[0].core[c]->icache()->refs()) {
+	fprintf(stderr, "Core [%d] ", c);
+	r[0].core[c]->print();
+      }
+  result_t* results = new result_t[n]();
+  for (int k=0; k<n; k++) {
+    for (int c=0; c<conf_cores; c++)
+      results[k].add(r[k].core[c]);
+    results[k].skipped = r[k].skipped;
+  }
+  fprintf(stderr, "\n");
+  print_results(results, labels, n);
+  fprintf(stderr, "\nReplayed %s in %3.1fs\n", (const char*)conf_replay, elapse_time());
+  exit(0);
+}
+
+/*
+  With --configs but not --replay the program is loaded, predecoded
+  and given its stack once, then a child process is forked for every
+  configuration, sharing all that copy-on-write.  At most --jobs run
+  at once.  Child k has perf segment --perf.k and writes the program's
+  output and its reports to --perf.k.log; the parent prints one table.
+*/
+const char* run_sweep()		// returns in child with its perf segment name
+{
+  config_t* configs;
+  char** labels;
+  int n = read_configs(&configs, &labels);
+  code.predecode_all();
+  result_t* results = (result_t*)mmap(0, n*sizeof(result_t), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  dieif(results==MAP_FAILED, "Cannot mmap sweep results");
+  long jobs = conf_jobs > 0 ? (long)conf_jobs : sysconf(_SC_NPROCESSORS_ONLN);
+  int running = 0;
+  for (int k=0; k<n || running>0; ) {
+    if (k < n && running < jobs) {
+      fflush(stdout);
+      fflush(stderr);
+      pid_t pid = fork();
+      dieif(pid < 0, "Cannot fork simulation %d", k);
+      if (pid == 0) {
+	machine = &configs[k];
+	sweep_result = &results[k];
+	static char name[256];
+	snprintf(name, sizeof name, "%s.%d", (const char*)conf_perf, k);
+	char log[300];
+	snprintf(log, sizeof log, "%s.log", name);
+	int fd = open(log, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	dieif(fd < 0, "Cannot create %s", log);
+	dup2(fd, 1);
+	dup2(fd, 2);
+	close(fd);
+	return name;
+      }
+      running++;
+      k++;
+      continue;
+    }
+    int status;
+    if (wait(&status) > 0)
+      running--;
+  }
+  fprintf(stderr, "%d configurations in %3.1fs, reports in %s.N.log\n\n", n, elapse_time(), (const char*)conf_perf);
+  print_results(results, labels, n);
+  exit(0);
+}
+
 int main(int argc, const char* argv[], const char* envp[])
 {
   parse_options(argc, argv, "caveat: user-mode RISC-V parallel simulator");
@@ -219,12 +791,28 @@ int main(int argc, const char* argv[], const char* envp[])
     help_exit();
   start_time();
   code.loadelf(argv[0]);
-  perf_t::create(code.base(), code.limit(), conf_cores, conf_perf);
+  if (conf_replay) {
+    dieif(conf_trace || conf_simpoints || conf_smarts || conf_roi || conf_skip, "--replay cannot be used with --trace, --roi, --skip or sampling");
+    run_replay();
+  }
+  dieif(conf_mrc, "--mrc needs --replay");
+  long sp = initialize_stack(argc, argv, envp);
+  const char* perf = conf_perf;
+  if (conf_configs) {
+    dieif(conf_trace, "--trace cannot be used with --configs");
+    perf = run_sweep();
+  }
+  perf_t::create(code.base(), code.limit(), conf_cores, perf);
   for (int i=0; i<perf_t::cores(); i++)
     new perf_t(i);
-  long sp = initialize_stack(argc, argv, envp);
+  if (conf_trace)
+    trace_setup();
+  int node = pin_thread(0);
   core_t* mycpu = new core_t();
+  if (node >= 0)
+    mycpu->place(node);
   mycpu->write_reg(2, sp);	// x2 is stack pointer
+  checkpoint_setup(mycpu);
   
   atexit(exitfunc);
 
@@ -237,59 +825,27 @@ int main(int argc, const char* argv[], const char* envp[])
   sigaction(SIGSEGV, &action, NULL);
 #endif
 
+  dieif(conf_simpoints && conf_smarts, "--simpoints and --smarts are exclusive");
+  dieif(conf_roi && (conf_simpoints || conf_smarts), "--roi cannot be used with sampling");
+  dieif(conf_skip && (conf_roi || conf_simpoints || conf_smarts), "--skip cannot be used with --roi or sampling");
+  if (conf_roi)
+    mycpu->mode = mode_fast;
+  if (conf_simpoints)
+    run_simpoints(mycpu);
+  if (conf_smarts)
+    run_smarts(mycpu);
+  if (conf_workers)
+    run_workers(mycpu);
   while (1) {
-    mycpu->interpreter(10000000L);
+    mycpu->interpreter(checkpoint_quantum(10000000L));
+    checkpoint_poll();
     double realtime = elapse_time();
-    fprintf(stderr, "\r\33[2K%12ld insns %3.1fs %3.1f MIPS IPC", core_t::total_count(), realtime, core_t::total_count()/1e6/realtime);
+    long total = core_t::total_count();
+    fprintf(stderr, "\r\33[2K%12ld insns %3.1fs %3.1f MIPS IPC", total, realtime, total/1e6/realtime);
     char separator = '=';
     for (core_t* p=core_t::list(); p; p=p->next()) {
-      fprintf(stderr, "%c%4.2f", separator, (double)p->executed()/p->local_clock());
+      fprintf(stderr, "%c%4.2f", separator, p->mem()->ipc());
       separator = ',';
     }
   }
 }
-
-extern "C" {
-
-#define poolsize  (1<<30)	/* size of simulation memory pool */
-
-static char simpool[poolsize];	/* base of memory pool */
-static volatile char* pooltop = simpool; /* current allocation address */
-
-void *malloc(size_t size)
-{
-  char volatile *rv, *newtop;
-  do {
-    volatile char* after = pooltop + size + 16; /* allow for alignment */
-    if (after > simpool+poolsize) {
-      fprintf(stderr, " failed\n");
-      return 0;
-    }
-    rv = pooltop;
-    newtop = (char*)((unsigned long)after & ~0xfL); /* always align to 16 bytes */
-  } while (!__sync_bool_compare_and_swap(&pooltop, rv, newtop));
-      
-  return (void*)rv;
-}
-
-void free(void *ptr)
-{
-  /* we don't free stuff */
-}
-
-void *calloc(size_t nmemb, size_t size)
-{
-  return malloc(nmemb * size);
-}
-
-void *realloc(void *ptr, size_t size)
-{
-  return 0;
-}
-
-void *reallocarray(void *ptr, size_t nmemb, size_t size)
-{
-  return 0;
-}
-
-};
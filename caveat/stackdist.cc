@@ -0,0 +1,211 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "options.h"
+#include "uspike.h"
+#include "instructions.h"
+#include "trace.h"
+#include "stackdist.h"
+
+option<>     conf_mrc("mrc",	0, "caveat.mrc",	"With --replay, miss ratio curves instead of caches, per PC to file");
+
+extern option<int> conf_Iline;
+extern option<int> conf_Dline;
+extern option<int> conf_cores;
+
+#define TREE_INITIAL  (1<<16)
+
+stackdist_t::stackdist_t()
+{
+  mask = (1<<12) - 1;
+  lines = new long[mask+1];
+  memset(lines, -1, (mask+1)*sizeof(long));
+  times = new long[mask+1];
+  used = 0;
+  size = TREE_INITIAL;
+  tree = new int[size+1]();
+  now = 1;
+  last = -1;
+}
+
+long stackdist_t::slot(long line)
+{
+  long k = (line * 0x9E3779B97F4A7C15UL >> 32) & mask;
+  while (lines[k] != -1 && lines[k] != line)
+    k = (k+1) & mask;
+  return k;
+}
+
+void stackdist_t::grow()
+{
+  long* oldlines = lines;
+  long* oldtimes = times;
+  long oldmask = mask;
+  mask = 2*mask + 1;
+  lines = new long[mask+1];
+  memset(lines, -1, (mask+1)*sizeof(long));
+  times = new long[mask+1];
+  for (long j=0; j<=oldmask; j++)
+    if (oldlines[j] != -1) {
+      long k = slot(oldlines[j]);
+      lines[k] = oldlines[j];
+      times[k] = oldtimes[j];
+    }
+  delete[] oldlines;
+  delete[] oldtimes;
+}
+
+void stackdist_t::renumber()
+{
+  long* order = new long[now]();	// slot+1 of line last referenced at time t
+  for (long k=0; k<=mask; k++)
+    if (lines[k] != -1)
+      order[times[k]] = k+1;
+  long n = 0;
+  for (long t=1; t<now; t++)
+    if (order[t])
+      times[order[t]-1] = ++n;
+  delete[] order;
+  if (4*n > size) {
+    delete[] tree;
+    size = 4*n;
+    tree = new int[size+1];
+  }
+  for (long i=1; i<=size; i++) {	// every time 1..n marked
+    long lo = i - (i & -i);
+    long hi = i < n ? i : n;
+    tree[i] = hi > lo ? hi - lo : 0;
+  }
+  now = n + 1;
+}
+
+// Capacities are 1..4 lines, then 4 steps per octave: 5,6,7,8,10,12,..
+long stackdist_t::capacity(int b)
+{
+  return b < 4 ? b+1 : (5L + (b-4)%4) << ((b-4)/4);
+}
+
+int stackdist_t::bucket(long d)
+{
+  if (d < 0)
+    return -1;
+  long n = d + 1;			// capacity needed to hit
+  if (n <= 4)
+    return n - 1;
+  int o = 63 - __builtin_clzl(n-1) - 2;
+  int b = 4 + 4*o + ((n + (1L<<o) - 1) >> o) - 5;
+  return b < STACKDIST_BUCKETS ? b : STACKDIST_BUCKETS-1;
+}
+
+static void print_size(FILE* f, long bytes)
+{
+  if      (bytes >= 1024*1024)  fprintf(f, "%8.1fMB", bytes/1024.0/1024);
+  else if (bytes >=      1024)  fprintf(f, "%8.1fKB", bytes/1024.0);
+  else                          fprintf(f, "%8ldB ", bytes);
+}
+
+// Misses in a cache of capacity(b) lines, from histogram indexed by bucket+1
+static long misses(long* hist, int b)
+{
+  long n = hist[0];
+  for (int j=b+2; j<=STACKDIST_BUCKETS; j++)
+    n += hist[j];
+  return n;
+}
+
+/*
+  Curves are of fully associative LRU caches of --iline and --dline
+  lines, private to each core.  Set associative caches of the same
+  capacity also have conflict misses.
+*/
+void miss_ratio_curves(const void* trace, long bytes)
+{
+  stackdist_t** icore = new stackdist_t*[conf_cores]();
+  stackdist_t** dcore = new stackdist_t*[conf_cores]();
+  long* last_pc = new long[conf_cores]();
+  long ihist[STACKDIST_BUCKETS+1] = { 0 }; // [0] is first references
+  long dhist[STACKDIST_BUCKETS+1] = { 0 };
+  long** perpc = new long*[(code.limit()-code.base())/2](); // data histograms by instruction
+  long skipped = 0;
+  trace_reader_t t(trace, bytes);
+  trace_rec_t r;
+  while (t.next(r)) {
+    if (r.core >= conf_cores) {
+      skipped++;
+      continue;
+    }
+    if (r.kind == trace_insn) {
+      if (!code.valid(r.addr)) {
+	skipped++;
+	continue;
+      }
+      last_pc[r.core] = r.addr;
+      if (!icore[r.core])
+	icore[r.core] = new stackdist_t;
+      ihist[stackdist_t::bucket(icore[r.core]->distance(r.addr >> conf_Iline)) + 1]++;
+      continue;
+    }
+    if (!dcore[r.core])
+      dcore[r.core] = new stackdist_t;
+    int b = stackdist_t::bucket(dcore[r.core]->distance(r.addr >> conf_Dline)) + 1;
+    dhist[b]++;
+    long pc = last_pc[r.core];
+    if (pc) {
+      long*& h = perpc[code.index(pc)];
+      if (!h)
+	h = new long[STACKDIST_BUCKETS+1]();
+      h[b]++;
+    }
+  }
+  long irefs=0, drefs=0;
+  int top = 0;				// last bucket with references
+  for (int j=0; j<=STACKDIST_BUCKETS; j++) {
+    irefs += ihist[j];
+    drefs += dhist[j];
+    if (j > 0 && (ihist[j] || dhist[j]))
+      top = j-1;
+  }
+  fprintf(stderr, "\nFully associative LRU miss ratio, %ld I$ and %ld D$ references\n", irefs, drefs);
+  fprintf(stderr, "%10s %10s %8s %10s %8s\n", "lines", "I$ size", "I$ miss", "D$ size", "D$ miss");
+  for (int b=0; b<=top+1 && b<STACKDIST_BUCKETS; b++) {
+    long c = stackdist_t::capacity(b);
+    fprintf(stderr, "%10ld ", c);
+    print_size(stderr, c << conf_Iline);
+    fprintf(stderr, " %8.5f ", irefs ? (double)misses(ihist, b)/irefs : 0.0);
+    print_size(stderr, c << conf_Dline);
+    fprintf(stderr, " %8.5f\n", drefs ? (double)misses(dhist, b)/drefs : 0.0);
+  }
+  if (skipped)
+    fprintf(stderr, "%ld records skipped, not of this program or beyond --cores\n", skipped);
+  // Per instruction D$ miss ratio at capacities that are powers of two
+  FILE* f = fopen(conf_mrc, "w");
+  dieif(!f, "Cannot create %s", (const char*)conf_mrc);
+  fprintf(f, "%35s%10s", "", "refs");
+  for (int b=0; b<=top+1 && b<STACKDIST_BUCKETS; b++)
+    if (b < 4 ? b != 2 : b%4 == 3) {
+      fputc(' ', f);
+      print_size(f, stackdist_t::capacity(b) << conf_Dline);
+    }
+  fputc('\n', f);
+  for (long k=0; k<(code.limit()-code.base())/2; k++) {
+    long* h = perpc[k];
+    if (!h)
+      continue;
+    long refs = 0;
+    for (int j=0; j<=STACKDIST_BUCKETS; j++)
+      refs += h[j];
+    labelpc(code.base()+2*k, f);
+    fprintf(f, "%10ld", refs);
+    for (int b=0; b<=top+1 && b<STACKDIST_BUCKETS; b++)
+      if (b < 4 ? b != 2 : b%4 == 3)
+	fprintf(f, " %10.5f", (double)misses(h, b)/refs);
+    fputc('\n', f);
+  }
+  fclose(f);
+}
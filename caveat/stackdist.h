@@ -0,0 +1,72 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+/*
+  LRU stack distance of a reference is the number of distinct lines
+  touched since the previous reference to its line.  It hits in every
+  fully associative LRU cache of more lines than that, so one pass
+  gives the miss ratio of all capacities at once.
+
+  Each line remembers the time of its last reference, and a Fenwick
+  tree over time marks the times that are still some line's latest, so
+  the distance is a count of marks between two times.  When time runs
+  off the end of the tree the live lines are renumbered 1..n in order,
+  so the tree needs only a few times the number of distinct lines.
+*/
+
+#ifndef STACKDIST_T
+#define STACKDIST_T
+
+#define STACKDIST_BUCKETS  160	/* capacities, 4 per octave */
+
+class stackdist_t {
+  long* lines;			// hash table of line numbers, -1 if slot free
+  long* times;			// of last reference to lines[k]
+  long mask;			// hash table size-1
+  long used;			// lines in table
+  int* tree;			// Fenwick tree [1..size] of latest times
+  long size;
+  long now;			// next time
+  long last;			// most recent line, distance 0 without lookup
+  long slot(long line);
+  void mark(long t, int d) { for (; t<=size; t+=t&-t) tree[t]+=d; }
+  long marks(long t) { long n=0; for (; t>0; t-=t&-t) n+=tree[t]; return n; }
+  void grow();			// double hash table
+  void renumber();		// compact times to 1..used
+public:
+  stackdist_t();
+  long distance(long line);	// -1 if first reference
+  static int bucket(long d);	// first capacity d hits in, -1 if cold
+  static long capacity(int b);	// in lines
+};
+
+inline long stackdist_t::distance(long line)
+{
+  if (line == last)
+    return 0;
+  last = line;
+  if (now > size)
+    renumber();
+  long k = slot(line);
+  long d = -1;
+  if (lines[k] == line) {
+    d = marks(now-1) - marks(times[k]);
+    mark(times[k], -1);
+  }
+  else {
+    lines[k] = line;
+    if (++used > mask/2) {
+      times[k] = now;
+      grow();
+      k = slot(line);
+    }
+  }
+  times[k] = now;
+  mark(now++, 1);
+  return d;
+}
+
+void miss_ratio_curves(const void* trace, long bytes);
+
+#endif
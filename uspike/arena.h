@@ -0,0 +1,244 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+// Memory allocator for the simulator itself, included once by the
+// main program to replace malloc() and friends.
+//
+// Guest threads cannot use glibc malloc (see spinlock_t in uspike.h).
+// Each thread instead picks an arena by hashing its stack address.
+// Arenas are locked, so threads that happen to share one are merely
+// slower.  Every block has a 16-byte header giving its size class, and
+// a freed block goes on the free list of the freeing thread's arena.
+// Memory comes from a static pool and is recycled but never returned.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#define POOL_SIZE  (1L<<30)	/* size of simulation memory pool */
+#define ARENAS     64		/* power of two */
+#define CHUNK      (1L<<20)	/* small classes are carved from chunks */
+#define CLASSES    100		/* blocks up to POOL_SIZE */
+
+option<bool> conf_mstats("mstats",	false, true,			"Print allocator statistics at exit");
+
+struct header_t {
+  long size_class;
+  long offset;			// from start of block to user pointer
+};
+
+struct free_t {
+  free_t* next;
+};
+
+struct alignas(64) arena_t {
+  spinlock_t lock;
+  char* chunk;			// remainder of current chunk
+  char* chunk_end;
+  free_t* free[CLASSES];
+  long allocs[CLASSES];
+  long frees[CLASSES];
+};
+
+static char simpool[POOL_SIZE] __attribute__((aligned(4096)));
+static volatile char* pooltop = simpool; /* current allocation address */
+static arena_t arena[ARENAS];
+
+// Classes are 16..128 in steps of 16, then four per power of two
+static int size_class(size_t n)
+{
+  if (n <= 128)
+    return (n+15)/16 - 1;
+  int lg = 63 - __builtin_clzl(n-1);
+  return 8 + (lg-7)*4 + ((n-1-(1L<<lg)) >> (lg-2));
+}
+
+static size_t class_size(int c)
+{
+  if (c < 8)
+    return 16*(c+1);
+  int lg = (c-8)/4 + 7;
+  return (1L<<lg) + ((c-8)%4+1)*(1L<<(lg-2));
+}
+
+static char* pool_alloc(size_t size)
+{
+  char volatile *rv, *newtop;
+  do {
+    rv = pooltop;
+    newtop = rv + ((size+15) & ~0xfL); /* always align to 16 bytes */
+    if (newtop > simpool+POOL_SIZE) {
+      fprintf(stderr, "Simulator memory pool exhausted\n");
+      return 0;
+    }
+  } while (!__sync_bool_compare_and_swap(&pooltop, rv, newtop));
+  return (char*)rv;
+}
+
+static arena_t* my_arena()
+{
+  unsigned long sp = (unsigned long)__builtin_frame_address(0);
+  return &arena[(sp>>16) * 0x9E3779B97F4A7C15UL >> 58];
+}
+
+static char* block_alloc(int c)
+{
+  size_t sz = class_size(c);
+  arena_t* a = my_arena();
+  a->lock.lock();
+  char* b = (char*)a->free[c];
+  if (b)
+    a->free[c] = a->free[c]->next;
+  else if (sz > CHUNK/16)
+    b = pool_alloc(sz);
+  else {
+    if (a->chunk+sz > a->chunk_end) {
+      a->chunk = pool_alloc(CHUNK);
+      a->chunk_end = a->chunk ? a->chunk+CHUNK : 0;
+    }
+    if (a->chunk) {
+      b = a->chunk;
+      a->chunk += sz;
+    }
+  }
+  if (b)
+    a->allocs[c]++;
+  a->lock.unlock();
+  return b;
+}
+
+extern "C" {
+
+void *memalign(size_t align, size_t size)
+{
+  if (align < 16)
+    align = 16;
+  size_t n = size + sizeof(header_t) + (align > 16 ? align : 0);
+  if (n < size || n > POOL_SIZE) {
+    errno = ENOMEM;
+    return 0;
+  }
+  int c = size_class(n);
+  char* b = block_alloc(c);
+  if (!b) {
+    errno = ENOMEM;
+    return 0;
+  }
+  char* p = (char*)(((unsigned long)b + sizeof(header_t) + align-1) & ~(align-1));
+  header_t* h = (header_t*)p - 1;
+  h->size_class = c;
+  h->offset = p - b;
+  return p;
+}
+
+void *malloc(size_t size)
+{
+  return memalign(16, size);
+}
+
+void free(void *ptr)
+{
+  if (!ptr)
+    return;
+  header_t* h = (header_t*)ptr - 1;
+  int c = h->size_class;
+  free_t* b = (free_t*)((char*)ptr - h->offset);
+  arena_t* a = my_arena();
+  a->lock.lock();
+  b->next = a->free[c];
+  a->free[c] = b;
+  a->frees[c]++;
+  a->lock.unlock();
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+  if (!ptr)
+    return 0;
+  header_t* h = (header_t*)ptr - 1;
+  return class_size(h->size_class) - h->offset;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+  size_t n;
+  if (__builtin_mul_overflow(nmemb, size, &n)) {
+    errno = ENOMEM;
+    return 0;
+  }
+  void* p = malloc(n);
+  if (p)
+    memset(p, 0, n);
+  return p;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+  if (!ptr)
+    return malloc(size);
+  if (size == 0) {
+    free(ptr);
+    return 0;
+  }
+  size_t old = malloc_usable_size(ptr);
+  if (size <= old)
+    return ptr;
+  void* p = malloc(size);
+  if (p) {
+    memcpy(p, ptr, old);
+    free(ptr);
+  }
+  return p;
+}
+
+void *reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+  size_t n;
+  if (__builtin_mul_overflow(nmemb, size, &n)) {
+    errno = ENOMEM;
+    return 0;
+  }
+  return realloc(ptr, n);
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size)
+{
+  void* p = memalign(align, size);
+  if (!p)
+    return ENOMEM;
+  *memptr = p;
+  return 0;
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+  return memalign(align, size);
+}
+
+void *valloc(size_t size)
+{
+  return memalign(4096, size);
+}
+
+void malloc_stats()
+{
+  fprintf(stderr, "\n%10s %12s %12s %12s %14s\n", "class", "allocs", "frees", "live", "live bytes");
+  long total_live = 0;
+  for (int c=0; c<CLASSES; c++) {
+    long allocs=0, frees=0;
+    for (int i=0; i<ARENAS; i++) {
+      allocs += arena[i].allocs[c];
+      frees  += arena[i].frees[c];
+    }
+    if (allocs == 0)
+      continue;
+    long live = allocs - frees;
+    total_live += live*class_size(c);
+    fprintf(stderr, "%10ld %12ld %12ld %12ld %14ld\n", class_size(c), allocs, frees, live, live*class_size(c));
+  }
+  fprintf(stderr, "%ld bytes live, %ld of %ld bytes of pool used\n", total_live, (long)(pooltop-simpool), POOL_SIZE);
+}
+
+};
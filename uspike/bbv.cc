@@ -0,0 +1,170 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+
+#include "options.h"
+#include "uspike.h"
+#include "instructions.h"
+#include "mmu.h"
+#include "hart.h"
+
+option<>     conf_bbv("bbv",		0, "uspike.bbv",		"Write basic block vectors to file");
+option<long> conf_interval("interval",	100000000,			"Instructions per basic block vector");
+
+/*
+  Basic block vectors for SimPoint-style sampling (see simpoint script).
+  A block starts at a jump target and is charged the instructions
+  executed until the next taken jump.  Each hart writes one vector
+  every --interval of its own instructions:
+
+    header   "cavabbv1", interval			16 bytes
+    vector   hart, n, interval number			16 bytes
+	     n x (block, instructions)			8 bytes each
+
+  where block is the halfword offset of its first instruction from the
+  start of the text segment.  A final partial interval is not written.
+*/
+
+#define BBV_MAGIC  "cavabbv1"
+
+struct bbv_header_t {
+  char magic[8];
+  long interval;
+};
+
+struct bbv_vector_t {
+  int32_t hart;
+  int32_t n;
+  long index;
+};
+
+struct bbv_entry_t {
+  uint32_t block;
+  uint32_t insns;
+};
+
+static int bbv_fd = -1;
+static spinlock_t bbv_lock;
+
+class bbv_mmu_t : public mmu_t {
+  bbv_entry_t* table;		// open addressing, insns=0 if slot free
+  long mask;
+  long used;
+  long start;			// first instruction of current block
+  long n;			// instructions in block so far
+  long slot(uint32_t block);
+  void add(long pc, long insns);
+public:
+  bbv_mmu_t();
+  void insn_model(long pc) { n++; }
+  long jump_model(long npc, long pc) { add(start, n); start=npc; n=0; return npc; }
+  void write(int hart, long index);
+};
+
+bbv_mmu_t::bbv_mmu_t()
+{
+  mask = (1<<12) - 1;
+  table = new bbv_entry_t[mask+1]();
+  used = 0;
+  start = code.entry();
+  n = 0;
+}
+
+long bbv_mmu_t::slot(uint32_t block)
+{
+  long k = (block * 0x9E3779B97F4A7C15UL >> 32) & mask;
+  while (table[k].insns && table[k].block != block)
+    k = (k+1) & mask;
+  return k;
+}
+
+void bbv_mmu_t::add(long pc, long insns)
+{
+  if (insns == 0)
+    return;
+  if (used > mask/2) {		// double table
+    bbv_entry_t* old = table;
+    long oldmask = mask;
+    mask = 2*mask + 1;
+    table = new bbv_entry_t[mask+1]();
+    for (long j=0; j<=oldmask; j++)
+      if (old[j].insns)
+	table[slot(old[j].block)] = old[j];
+    delete[] old;
+  }
+  uint32_t block = (pc - code.base()) >> 1;
+  long k = slot(block);
+  if (!table[k].insns) {
+    table[k].block = block;
+    used++;
+  }
+  table[k].insns += insns;
+}
+
+void bbv_mmu_t::write(int hart, long index)
+{
+  add(start, n);		// block continues into next interval
+  n = 0;
+  long sz = sizeof(bbv_vector_t) + used*sizeof(bbv_entry_t);
+  char* buf = new char[sz];
+  bbv_vector_t* v = (bbv_vector_t*)buf;
+  bbv_entry_t* e = (bbv_entry_t*)(v+1);
+  v->hart = hart;
+  v->n = used;
+  v->index = index;
+  for (long k=0; k<=mask; k++)
+    if (table[k].insns)
+      *e++ = table[k];
+  memset(table, 0, (mask+1)*sizeof(bbv_entry_t));
+  used = 0;
+  bbv_lock.lock();
+  dieif(::write(bbv_fd, buf, sz) != sz, "Cannot write %s", (const char*)conf_bbv);
+  bbv_lock.unlock();
+  delete[] buf;
+}
+
+class bbv_hart_t : public hart_t {
+  long index;			// current interval
+public:
+  bbv_hart_t() : hart_t(new bbv_mmu_t) { index=0; }
+  bbv_hart_t(bbv_hart_t* p) : hart_t(p, new bbv_mmu_t) { index=0; }
+  hart_t* newcore() { return new bbv_hart_t(this); }
+  bool interpreter(long how_many);
+  bbv_mmu_t* model() { return static_cast<bbv_mmu_t*>(mmu()); }
+};
+
+#include "spike_link.h"
+#include "interpreter.h"
+
+// Stop exactly at each interval boundary to write the vector
+bool bbv_hart_t::interpreter(long how_many)
+{
+  while (how_many > 0) {
+    long before = executed();
+    long end = (index+1)*conf_interval;
+    bool trapped = hart_t::interpreter<bbv_mmu_t>(how_many < end-before ? how_many : end-before);
+    how_many -= executed() - before;
+    if (executed() >= end)
+      model()->write(number(), index++);
+    if (trapped || suspended())
+      return trapped;
+  }
+  return false;
+}
+
+hart_t* bbv_hart()
+{
+  dieif(conf_interval <= 0 || conf_interval > UINT32_MAX, "--interval=%ld out of range", (long)conf_interval);
+  bbv_fd = open(conf_bbv, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  dieif(bbv_fd < 0, "Cannot create %s", (const char*)conf_bbv);
+  bbv_header_t h;
+  memcpy(h.magic, BBV_MAGIC, sizeof h.magic);
+  h.interval = conf_interval;
+  dieif(write(bbv_fd, &h, sizeof h) != sizeof h, "Cannot write %s", (const char*)conf_bbv);
+  return new bbv_hart_t();
+}
@@ -0,0 +1,499 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "options.h"
+#include "uspike.h"
+#include "instructions.h"
+#include "mmu.h"
+#include "hart.h"
+#include "fpfast.h"
+
+#include "elf_loader.h"
+
+option<>     conf_ckpt("checkpoint",	0, "uspike.ckpt",		"Checkpoint file, written on SIGUSR1 or at --ckpt_at");
+option<long> conf_ckpt_at("ckpt_at",	0,				"Write checkpoint after N instructions and exit, 0=never");
+option<>     conf_restore("restore",	0, "uspike.ckpt",		"Start from checkpoint file instead of ELF entry");
+
+/*
+  A checkpoint holds every guest memory region, the program break, the
+  registers of every hart and the regular files open in the guest.  The
+  guest shares the host address space, so regions are tracked as the
+  ELF loader and guest system calls map and unmap them.  The file is
+  metadata followed by page-aligned memory contents, with all-zero
+  pages left as holes.  Restoring maps the contents copy-on-write at
+  the same addresses, so only pages actually touched are ever read.
+
+  Harts must all be stopped between instructions: with --workers the
+  workers park (see scheduler.cc), otherwise there must be one hart.
+*/
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE  0x100000
+#endif
+
+#define CKPT_MAGIC    "cavackpt"
+#define CKPT_VERSION  1
+#define MAX_REGIONS   4096
+#define PAGE          4096L
+
+struct ckpt_header_t {
+  char magic[8];
+  long version;
+  long entry;			// of ELF program, checked when restoring
+  long insns;			// executed when written
+  long brk, brk_min, brk_max;
+  int harts, regions, fds;
+  long data;			// file offset of memory contents
+};
+
+// Followed by vector registers, vlen/8*32 bytes, if spike is set
+struct ckpt_hart_t {
+  long tid;
+  int blocked;			// waiting on futex_addr
+  int spike;			// Spike state below is valid
+  long x[32];
+  long pc;
+  uint64_t f[32][2];
+  long fflags, frm;
+  long vlen, vl, vtype, vstart;
+  long futex_addr;
+  long futex_bitset;
+  long futex_timeout;		// ns remaining, 0=forever
+  long clear_tid;
+};
+
+struct ckpt_region_t {
+  long lo, hi;
+  int prot;
+  int data;			// 0=not readable, mapped without contents
+  long offset;			// in file
+};
+
+struct ckpt_fd_t {
+  int fd;
+  int flags;
+  long offset;
+  char path[512];
+};
+
+/*
+  Guest regions, sorted and merged, in whole pages.
+*/
+struct range_t {
+  long lo, hi;
+};
+
+static range_t ranges[MAX_REGIONS];
+static range_t spare[MAX_REGIONS];	// guest thread stacks are small
+static int num_ranges;
+static spinlock_t range_lock;
+
+extern "C" void guest_unmapped(long lo, long len)
+{
+  long hi = (lo + len + PAGE-1) & ~(PAGE-1);
+  lo &= ~(PAGE-1);
+  range_lock.lock();
+  int n = 0;
+  for (int k=0; k<num_ranges; k++) {
+    range_t r = ranges[k];
+    dieif(n+2 > MAX_REGIONS, "More than %d guest memory regions", MAX_REGIONS);
+    if (r.hi <= lo || hi <= r.lo)
+      spare[n++] = r;
+    else {
+      if (r.lo < lo)
+	spare[n++] = { r.lo, lo };
+      if (hi < r.hi)
+	spare[n++] = { hi, r.hi };
+    }
+  }
+  memcpy(ranges, spare, n*sizeof(range_t));
+  num_ranges = n;
+  range_lock.unlock();
+}
+
+extern "C" void guest_mapped(long lo, long len)
+{
+  long hi = (lo + len + PAGE-1) & ~(PAGE-1);
+  lo &= ~(PAGE-1);
+  range_lock.lock();
+  int k = 0;
+  while (k < num_ranges && ranges[k].hi < lo)
+    k++;
+  int j = k;			// [k,j) overlap or touch new range
+  while (j < num_ranges && ranges[j].lo <= hi) {
+    if (ranges[j].lo < lo)  lo = ranges[j].lo;
+    if (ranges[j].hi > hi)  hi = ranges[j].hi;
+    j++;
+  }
+  dieif(num_ranges-(j-k)+1 > MAX_REGIONS, "More than %d guest memory regions", MAX_REGIONS);
+  memmove(&ranges[k+1], &ranges[j], (num_ranges-j)*sizeof(range_t));
+  ranges[k] = { lo, hi };
+  num_ranges += 1 - (j-k);
+  range_lock.unlock();
+}
+
+/*
+  Triggers
+*/
+static volatile int ckpt_signal;
+
+static void ckpt_handler(int signum)
+{
+  ckpt_signal = 1;
+}
+
+bool checkpoint_due()
+{
+  if (!conf_ckpt)
+    return false;
+  return ckpt_signal || (conf_ckpt_at && hart_t::total_count() >= conf_ckpt_at);
+}
+
+long checkpoint_quantum(long how_many)
+{
+  if (conf_ckpt && conf_ckpt_at) {
+    long left = conf_ckpt_at - hart_t::total_count();
+    if (left > 0 && left < how_many)
+      return left;
+  }
+  return how_many;
+}
+
+void checkpoint_poll()
+{
+  if (!checkpoint_due())
+    return;
+  dieif(hart_t::threads() > 1, "Checkpoint of multithreaded guest needs --workers");
+  write_checkpoint();
+}
+
+#include "spike_link.h"
+
+struct ckpt_t {
+  static void save(hart_t* h, ckpt_hart_t* r);
+  static void load(hart_t* h, ckpt_hart_t* r, const char* vregs);
+  static long timeout(hart_t* h);
+  static void write();
+};
+
+void ckpt_t::save(hart_t* h, ckpt_hart_t* r)
+{
+  memset(r, 0, sizeof *r);
+  r->tid = h->my_tid;
+  r->blocked = h->sched_state == sched_blocked;
+  for (int i=0; i<32; i++)
+    r->x[i] = h->read_reg(i);
+  r->pc = h->read_pc();
+  if (h->spike_cpu) {
+    processor_t* p = h->spike_cpu;
+    r->spike = 1;
+    for (int i=0; i<32; i++) {
+      freg_t f = STATE.FPR[i];
+      r->f[i][0] = f.v[0];
+      r->f[i][1] = f.v[1];
+    }
+    r->fflags = STATE.fflags;
+    r->frm = STATE.frm;
+    r->vlen = p->VU.VLEN;
+    r->vl = p->VU.vl;
+    r->vtype = p->VU.vtype;
+    r->vstart = p->VU.vstart;
+  }
+  if (r->blocked) {
+    r->futex_addr = (long)h->futex_addr;
+    r->futex_bitset = h->futex_bitset;
+    r->futex_timeout = timeout(h);
+  }
+  r->clear_tid = (long)h->clear_tid;
+}
+
+long ckpt_t::timeout(hart_t* h)
+{
+  if (!h->futex_deadline)
+    return 0;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  long left = h->futex_deadline - (ts.tv_sec*1000000000L + ts.tv_nsec);
+  return left > 0 ? left : 1;
+}
+
+void ckpt_t::load(hart_t* h, ckpt_hart_t* r, const char* vregs)
+{
+  if (r->spike) {
+    processor_t* p = h->spike();
+    dieif(p->VU.VLEN != r->vlen, "Checkpoint has VLEN=%ld, this --vec has %ld", r->vlen, (long)p->VU.VLEN);
+    for (int i=0; i<32; i++) {
+      freg_t f;
+      f.v[0] = r->f[i][0];
+      f.v[1] = r->f[i][1];
+      STATE.FPR.write(i, f);
+    }
+    STATE.fflags = r->fflags;
+    STATE.frm = r->frm;
+    memcpy(p->VU.reg_file, vregs, r->vlen/8*32);
+    p->VU.set_vl(1, 1, r->vl, r->vtype);
+    p->VU.vstart = r->vstart;
+  }
+  for (int i=1; i<32; i++)
+    h->write_reg(i, r->x[i]);
+  h->write_pc(r->pc);
+  if (conf_workers)
+    h->my_tid = r->tid;		// emulated, else host thread id
+  h->sched_state = r->blocked ? sched_blocked : sched_running;
+  h->futex_addr = (int*)r->futex_addr;
+  h->futex_bitset = r->futex_bitset;
+  h->futex_deadline = 0;
+  if (r->futex_timeout) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    h->futex_deadline = ts.tv_sec*1000000000L + ts.tv_nsec + r->futex_timeout;
+  }
+  h->clear_tid = (int*)r->clear_tid;
+}
+
+static bool zero_page(const long* p)
+{
+  for (int i=0; i<PAGE/8; i++)
+    if (p[i])
+      return false;
+  return true;
+}
+
+// Guest regions as currently mapped, with their protection
+static int gather_regions(ckpt_region_t* reg)
+{
+  FILE* maps = fopen("/proc/self/maps", "r");
+  dieif(!maps, "Cannot read /proc/self/maps");
+  int n = 0;
+  char line[1024];
+  range_lock.lock();
+  while (fgets(line, sizeof line, maps)) {
+    long lo, hi;
+    char perms[8];
+    if (sscanf(line, "%lx-%lx %7s", &lo, &hi, perms) != 3)
+      continue;
+    int prot = (perms[0]=='r' ? PROT_READ : 0) | (perms[1]=='w' ? PROT_WRITE : 0) | (perms[2]=='x' ? PROT_EXEC : 0);
+    for (int k=0; k<num_ranges; k++) {
+      long a = lo > ranges[k].lo ? lo : ranges[k].lo;
+      long b = hi < ranges[k].hi ? hi : ranges[k].hi;
+      if (a >= b)
+	continue;
+      dieif(n == MAX_REGIONS, "More than %d guest memory regions", MAX_REGIONS);
+      reg[n++] = { a, b, prot, (prot & (PROT_READ|PROT_WRITE)) != 0, 0 };
+    }
+  }
+  range_lock.unlock();
+  fclose(maps);
+  return n;
+}
+
+// Regular files open in the guest; simulator files other than fd are not
+// distinguished, and pipes and sockets cannot be reopened
+static int gather_fds(ckpt_fd_t* fds, int max, int skip)
+{
+  DIR* dir = opendir("/proc/self/fd");
+  dieif(!dir, "Cannot read /proc/self/fd");
+  int n = 0;
+  while (struct dirent* d = readdir(dir)) {
+    int fd = atoi(d->d_name);
+    if (fd < 3 || fd == skip || fd == dirfd(dir) || n == max)
+      continue;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+      continue;
+    char link[64];
+    snprintf(link, sizeof link, "/proc/self/fd/%d", fd);
+    ckpt_fd_t* f = &fds[n];
+    memset(f, 0, sizeof *f);
+    ssize_t len = readlink(link, f->path, sizeof f->path - 1);
+    if (len <= 0 || len == sizeof f->path - 1 || f->path[0] != '/')
+      continue;
+    f->fd = fd;
+    f->flags = fcntl(fd, F_GETFL);
+    f->offset = lseek(fd, 0, SEEK_CUR);
+    n++;
+  }
+  closedir(dir);
+  return n;
+}
+
+void ckpt_t::write()
+{
+  ckpt_signal = 0;
+  long insns = hart_t::total_count();
+  char tmpname[1040];
+  snprintf(tmpname, sizeof tmpname, "%s.%d", (const char*)conf_ckpt, getpid());
+  FILE* f = fopen(tmpname, "w");
+  dieif(!f, "Cannot create checkpoint %s", tmpname);
+
+  int nh = 0;
+  hart_t** harts = new hart_t*[hart_t::threads()];
+  for (int k=0; k<hart_t::threads(); k++)	// in order of number()
+    for (hart_t* h=hart_t::list(); h; h=h->next())
+      if (h->number() == k && h->sched_state != sched_exited)
+	harts[nh++] = h;
+  ckpt_region_t* reg = new ckpt_region_t[MAX_REGIONS];
+  int nr = gather_regions(reg);
+  ckpt_fd_t* fds = new ckpt_fd_t[256];
+  int nf = gather_fds(fds, 256, fileno(f));
+
+  ckpt_header_t hdr;
+  memset(&hdr, 0, sizeof hdr);
+  memcpy(hdr.magic, CKPT_MAGIC, sizeof hdr.magic);
+  hdr.version = CKPT_VERSION;
+  hdr.entry = code.entry();
+  hdr.insns = insns;
+  hdr.brk = current.brk;
+  hdr.brk_min = current.brk_min;
+  hdr.brk_max = current.brk_max;
+  hdr.harts = nh;
+  hdr.regions = nr;
+  hdr.fds = nf;
+  ckpt_hart_t* hr = new ckpt_hart_t[nh];
+  long meta = sizeof hdr + nh*sizeof(ckpt_hart_t) + nr*sizeof(ckpt_region_t) + nf*sizeof(ckpt_fd_t);
+  for (int k=0; k<nh; k++) {
+    ckpt_t::save(harts[k], &hr[k]);
+    if (hr[k].spike)
+      meta += hr[k].vlen/8*32;
+  }
+  hdr.data = (meta + PAGE-1) & ~(PAGE-1);
+  long offset = hdr.data;
+  for (int k=0; k<nr; k++)
+    if (reg[k].data) {
+      reg[k].offset = offset;
+      offset += reg[k].hi - reg[k].lo;
+    }
+
+  bool ok = fwrite(&hdr, sizeof hdr, 1, f) == 1;
+  for (int k=0; k<nh; k++) {
+    ok = ok && fwrite(&hr[k], sizeof hr[k], 1, f) == 1;
+    if (hr[k].spike)
+      ok = ok && fwrite(harts[k]->spike_cpu->VU.reg_file, hr[k].vlen/8*32, 1, f) == 1;
+  }
+  ok = ok && fwrite(reg, sizeof(ckpt_region_t), nr, f) == (size_t)nr;
+  ok = ok && fwrite(fds, sizeof(ckpt_fd_t), nf, f) == (size_t)nf;
+  ok = ok && fflush(f) == 0;
+  int fd = fileno(f);
+  for (int k=0; k<nr && ok; k++) {
+    if (!reg[k].data)
+      continue;
+    for (long a=reg[k].lo; a<reg[k].hi && ok; ) {
+      if (zero_page((long*)a)) {
+	a += PAGE;
+	continue;
+      }
+      long b = a + PAGE;	// write run of nonzero pages
+      while (b < reg[k].hi && !zero_page((long*)b))
+	b += PAGE;
+      ok = pwrite(fd, (void*)a, b-a, reg[k].offset + (a-reg[k].lo)) == b-a;
+      a = b;
+    }
+  }
+  ok = ok && ftruncate(fd, offset) == 0;
+  ok = fclose(f) == 0 && ok;
+  dieif(!ok, "Cannot write checkpoint %s", tmpname);
+  dieif(rename(tmpname, conf_ckpt) < 0, "Cannot rename checkpoint to %s", (const char*)conf_ckpt);
+  delete[] harts;
+  delete[] reg;
+  delete[] fds;
+  delete[] hr;
+  fprintf(stderr, "\nCheckpoint %s written after %ld instructions, %d threads, %d regions\n",
+	  (const char*)conf_ckpt, insns, nh, nr);
+  if (conf_ckpt_at && insns >= conf_ckpt_at)
+    exit(0);
+}
+
+// Caller has stopped every hart between instructions
+void write_checkpoint()
+{
+  ckpt_t::write();
+}
+
+static void restore_checkpoint(hart_t* first)
+{
+  FILE* f = fopen(conf_restore, "r");
+  dieif(!f, "Cannot open checkpoint %s", (const char*)conf_restore);
+  ckpt_header_t hdr;
+  dieif(fread(&hdr, sizeof hdr, 1, f) != 1 || memcmp(hdr.magic, CKPT_MAGIC, sizeof hdr.magic) || hdr.version != CKPT_VERSION,
+	"%s is not a checkpoint", (const char*)conf_restore);
+  dieif(hdr.entry != code.entry(), "Checkpoint %s is not of this program", (const char*)conf_restore);
+  dieif(hdr.harts > 1 && !conf_workers, "Checkpoint has %d threads, restore with --workers", hdr.harts);
+
+  hart_t* h = first;
+  for (int k=0; k<hdr.harts; k++) {
+    ckpt_hart_t r;
+    dieif(fread(&r, sizeof r, 1, f) != 1, "Checkpoint %s truncated", (const char*)conf_restore);
+    char* vregs = 0;
+    if (r.spike) {
+      vregs = new char[r.vlen/8*32];
+      dieif(fread(vregs, r.vlen/8*32, 1, f) != 1, "Checkpoint %s truncated", (const char*)conf_restore);
+    }
+    if (k > 0)
+      h = first->newcore();
+    ckpt_t::load(h, &r, vregs);
+    delete[] vregs;
+  }
+
+  // Replace memory set up by the ELF loader
+  range_lock.lock();
+  for (int k=0; k<num_ranges; k++)
+    munmap((void*)ranges[k].lo, ranges[k].hi-ranges[k].lo);
+  num_ranges = 0;
+  range_lock.unlock();
+  int fd = fileno(f);
+  for (int k=0; k<hdr.regions; k++) {
+    ckpt_region_t r;
+    dieif(fread(&r, sizeof r, 1, f) != 1, "Checkpoint %s truncated", (const char*)conf_restore);
+    int flags = MAP_PRIVATE|MAP_FIXED_NOREPLACE;
+    void* m = r.data ? mmap((void*)r.lo, r.hi-r.lo, r.prot, flags, fd, r.offset)
+      :                mmap((void*)r.lo, r.hi-r.lo, r.prot, flags|MAP_ANONYMOUS, -1, 0);
+    dieif(m != (void*)r.lo, "Cannot map guest memory [%lx,%lx) from checkpoint, perhaps try setarch -R", r.lo, r.hi);
+    guest_mapped(r.lo, r.hi-r.lo);
+  }
+  current.brk = hdr.brk;
+  current.brk_min = hdr.brk_min;
+  current.brk_max = hdr.brk_max;
+
+  // Checkpoint itself may be using a guest fd number, so close it first
+  ckpt_fd_t* fds = new ckpt_fd_t[hdr.fds];
+  dieif(fread(fds, sizeof(ckpt_fd_t), hdr.fds, f) != (size_t)hdr.fds, "Checkpoint %s truncated", (const char*)conf_restore);
+  fclose(f);
+  for (int k=0; k<hdr.fds; k++) {
+    ckpt_fd_t* r = &fds[k];
+    int n = open(r->path, r->flags & ~(O_CREAT|O_EXCL|O_TRUNC|O_NOCTTY));
+    if (n < 0) {
+      fprintf(stderr, "Checkpoint file %s for fd %d cannot be opened\n", r->path, r->fd);
+      continue;
+    }
+    if (n != r->fd) {
+      dieif(dup2(n, r->fd) < 0, "Cannot reopen %s as fd %d", r->path, r->fd);
+      close(n);
+    }
+    lseek(r->fd, r->offset, SEEK_SET);
+  }
+  delete[] fds;
+  fprintf(stderr, "Restored %s taken after %ld instructions, %d threads\n",
+	  (const char*)conf_restore, hdr.insns, hdr.harts);
+}
+
+void checkpoint_setup(hart_t* first)
+{
+  dieif(conf_ckpt_at && !conf_ckpt, "--ckpt_at needs --checkpoint=file");
+  if (conf_ckpt)
+    signal(SIGUSR1, ckpt_handler);
+  if (conf_restore)
+    restore_checkpoint(first);
+}
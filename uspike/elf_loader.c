@@ -26,6 +26,10 @@
 #define STACK_SIZE	0x01000000L
 #define BRK_SIZE	0x01000000L
 
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE  0x100000
+#endif
+
 struct pinfo_t current;
 unsigned long low_bound, high_bound;
 
@@ -132,6 +136,7 @@ long load_elf_binary( const char* file_name, int include_data )
       size_t mapped = ROUNDUP(ph[i].p_filesz + prepad, RISCV_PGSIZE) - prepad;
       if (ph[i].p_memsz > mapped)
         dieif(mmap((void*)(vaddr+mapped), ph[i].p_memsz - mapped, prot, flags|MAP_ANONYMOUS, 0, 0) != (void*)(vaddr+mapped), "Could not mmap()\n");      
+      guest_mapped(vaddr-prepad, ph[i].p_memsz + prepad);
     }
     info->brk_max = info->brk_min + BRK_SIZE;
   }
@@ -186,6 +191,7 @@ long load_elf_binary( const char* file_name, int include_data )
   info->stack_top = MEM_END;
   stack_lowest = (long)mmap((void*)(info->stack_top-STACK_SIZE), STACK_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
   dieif(stack_lowest != info->stack_top-STACK_SIZE, "Could not allocate stack\n");
+  guest_mapped(stack_lowest, STACK_SIZE);
 
   return current.entry;
 }
@@ -285,6 +291,33 @@ long initialize_stack(int argc, const char** argv, const char** envp)
 }
 
 
+/*
+  The guest program break is ours, not the host process break, so it is
+  at the same address in every run and known to checkpoints.
+*/
+long emulate_brk(long addr)
+{
+  struct pinfo_t* info = &current;
+  if (info->brk == 0)
+    info->brk = info->brk_min;
+  if (addr < info->brk_min || addr > info->brk_max)
+    return info->brk;		/* includes brk(0) query */
+  long top = ROUNDUP(info->brk, RISCV_PGSIZE);
+  long newtop = ROUNDUP(addr, RISCV_PGSIZE);
+  if (newtop > top) {
+    if (mmap((void*)top, newtop-top, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED_NOREPLACE, -1, 0) != (void*)top)
+      return info->brk;
+    guest_mapped(top, newtop-top);
+  }
+  else if (newtop < top) {
+    munmap((void*)newtop, top-newtop);
+    guest_unmapped(newtop, top-newtop);
+  }
+  info->brk = addr;
+  return addr;
+}
+
+
 int elf_find_symbol(const char* name, long* begin, long* end)
 {
   if (strtbl) {
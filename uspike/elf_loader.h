@@ -31,6 +31,8 @@ const char* elf_find_pc(long pc, long* offset);
 
 long initialize_stack(int argc, const char** argv, const char** envp);
 long emulate_brk(long addr);
+void guest_mapped(long lo, long len);	/* regions for checkpoint */
+void guest_unmapped(long lo, long len);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,189 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <xmmintrin.h>
+#include <emmintrin.h>
+
+#include "options.h"
+#include "uspike.h"
+#include "instructions.h"
+#include "mmu.h"
+#include "hart.h"
+#include "spike_link.h"
+#include "fpfast.h"
+
+/*
+  This file is compiled without -ffast-math (see Makefile).  With
+  round-to-nearest-even, denormals not flushed and no NaN operands, SSE
+  produces the same bits as softfloat and raises the same exceptions
+  (x86 and RISC-V both detect tininess after rounding).  NaN results
+  are replaced by the RISC-V canonical NaN.  Every other case, and all
+  other rounding modes, go to the golden[] Spike handler.
+*/
+
+extern long (*golden[])(long pc, mmu_t& MMU, class processor_t* p);
+
+#define MXCSR_DEFAULT  0x1F80	/* all exceptions masked, RNE, no FTZ/DAZ */
+#define MXCSR_FLAGS    0x003F
+
+void fp_begin()
+{
+  _mm_setcsr(MXCSR_DEFAULT);
+}
+
+void fp_sync(processor_t* p)
+{
+  unsigned csr = _mm_getcsr();
+  if (!(csr & MXCSR_FLAGS))
+    return;
+  if (csr & 0x01)  softfloat_exceptionFlags |= softfloat_flag_invalid;
+  if (csr & 0x04)  softfloat_exceptionFlags |= softfloat_flag_infinite;
+  if (csr & 0x08)  softfloat_exceptionFlags |= softfloat_flag_overflow;
+  if (csr & 0x10)  softfloat_exceptionFlags |= softfloat_flag_underflow;
+  if (csr & 0x20)  softfloat_exceptionFlags |= softfloat_flag_inexact;
+  set_fp_exceptions;
+  _mm_setcsr(csr & ~MXCSR_FLAGS);
+}
+
+static inline double D(float64_t f) { double d; memcpy(&d, &f.v, 8); return d; }
+static inline float  S(float32_t f) { float  s; memcpy(&s, &f.v, 4); return s; }
+
+static inline float64_t F64(double d)
+{
+  float64_t f;
+  if (d != d)
+    f.v = 0x7FF8000000000000UL;
+  else
+    memcpy(&f.v, &d, 8);
+  return f;
+}
+
+static inline float32_t F32(float s)
+{
+  float32_t f;
+  if (s != s)
+    f.v = 0x7FC00000U;
+  else
+    memcpy(&f.v, &s, 4);
+  return f;
+}
+
+static inline bool rne(long rm, processor_t* p) { return rm==0 || (rm==7 && STATE.frm==0); }
+static inline bool rtz(long rm, processor_t* p) { return rm==1 || (rm==7 && STATE.frm==1); }
+
+#define frs1  READ_FREG(i.rs1()-FPREG)
+#define frs2  READ_FREG(i.rs2()-FPREG)
+#define frs3  READ_FREG(i.rs3()-FPREG)
+#define wfrd(v)  WRITE_FREG(i.rd()-FPREG, v)
+#define wrd(v)   WRITE_REG(i.rd(), v)
+#define xrs1     READ_REG(i.rs1())
+
+#define GOLDEN   { golden[i.opcode()](pc, MMU, p); return; }
+
+// R4-type instructions have no immediate field, rm is in the image
+#define rm_r4    (code.image(pc)>>12 & 7)
+
+#define ARITH2(name, T, unbox, box, expr)			\
+  FP_FAST(name) {						\
+    T a=unbox(frs1), b=unbox(frs2);				\
+    if (!rne(i.immed(), p) || a!=a || b!=b)  GOLDEN;		\
+    wfrd(box(expr));						\
+  }
+
+#define ARITH1(name, T, unbox, box, expr)			\
+  FP_FAST(name) {						\
+    T a=unbox(frs1);						\
+    if (!rne(i.immed(), p) || a!=a)  GOLDEN;			\
+    wfrd(box(expr));						\
+  }
+
+#define ARITH3(name, T, unbox, box, expr)			\
+  FP_FAST(name) {						\
+    T a=unbox(frs1), b=unbox(frs2), c=unbox(frs3);		\
+    if (!rne(rm_r4, p) || a!=a || b!=b || c!=c)  GOLDEN;	\
+    wfrd(box(expr));						\
+  }
+
+#define MINMAX(name, T, unbox, box, less)			\
+  FP_FAST(name) {						\
+    T a=unbox(frs1), b=unbox(frs2);				\
+    if (a!=a || b!=b)  GOLDEN;					\
+    wfrd(box((less) ? a : b));					\
+  }
+
+#define COMPARE(name, T, unbox, expr)				\
+  FP_FAST(name) {						\
+    T a=unbox(frs1), b=unbox(frs2);				\
+    if (a!=a || b!=b)  GOLDEN;					\
+    wrd(expr);							\
+  }
+
+#define D64(r)  D(f64(r))
+#define S32(r)  S(f32(r))
+
+ARITH2(fadd_d, double, D64, F64, a+b)
+ARITH2(fsub_d, double, D64, F64, a-b)
+ARITH2(fmul_d, double, D64, F64, a*b)
+ARITH2(fdiv_d, double, D64, F64, a/b)
+ARITH1(fsqrt_d, double, D64, F64, sqrt(a))
+ARITH3(fmadd_d,  double, D64, F64, fma( a, b,  c))
+ARITH3(fmsub_d,  double, D64, F64, fma( a, b, -c))
+ARITH3(fnmsub_d, double, D64, F64, fma(-a, b,  c))
+ARITH3(fnmadd_d, double, D64, F64, fma(-a, b, -c))
+MINMAX(fmin_d, double, D64, F64, a<b || (a==b && signbit(a)))
+MINMAX(fmax_d, double, D64, F64, a>b || (a==b && signbit(b)))
+COMPARE(feq_d, double, D64, a==b)
+COMPARE(flt_d, double, D64, a<b)
+COMPARE(fle_d, double, D64, a<=b)
+
+ARITH2(fadd_s, float, S32, F32, a+b)
+ARITH2(fsub_s, float, S32, F32, a-b)
+ARITH2(fmul_s, float, S32, F32, a*b)
+ARITH2(fdiv_s, float, S32, F32, a/b)
+ARITH1(fsqrt_s, float, S32, F32, sqrtf(a))
+ARITH3(fmadd_s,  float, S32, F32, fmaf( a, b,  c))
+ARITH3(fmsub_s,  float, S32, F32, fmaf( a, b, -c))
+ARITH3(fnmsub_s, float, S32, F32, fmaf(-a, b,  c))
+ARITH3(fnmadd_s, float, S32, F32, fmaf(-a, b, -c))
+MINMAX(fmin_s, float, S32, F32, a<b || (a==b && signbit(a)))
+MINMAX(fmax_s, float, S32, F32, a>b || (a==b && signbit(b)))
+COMPARE(feq_s, float, S32, a==b)
+COMPARE(flt_s, float, S32, a<b)
+COMPARE(fle_s, float, S32, a<=b)
+
+ARITH1(fcvt_d_s, float,  S32, F64, double(a))
+ARITH1(fcvt_s_d, double, D64, F32, float(a))
+
+#define FROM_INT(name, box, T, I)				\
+  FP_FAST(name) {						\
+    if (!rne(i.immed(), p))  GOLDEN;				\
+    wfrd(box(T(I(xrs1))));					\
+  }
+
+FROM_INT(fcvt_d_w, F64, double, int32_t)
+FROM_INT(fcvt_d_l, F64, double, int64_t)
+FROM_INT(fcvt_s_w, F32, float,  int32_t)
+FROM_INT(fcvt_s_l, F32, float,  int64_t)
+
+// Out of range and NaN operands fail the bounds test and go golden.
+// The bounds keep the rounded result representable in either mode.
+#define TO_INT(name, T, unbox, I, lo, hi, cvt)			\
+  FP_FAST(name) {						\
+    T a = unbox(frs1);						\
+    if (!(a >= lo && a < hi))  GOLDEN;				\
+    long rm = i.immed();					\
+    if (rtz(rm, p))						\
+      wrd(I(a));						\
+    else if (rne(rm, p))					\
+      wrd(I(cvt));						\
+    else							\
+      GOLDEN;							\
+  }
+
+TO_INT(fcvt_w_d, double, D64, int32_t, -0x1p31, 2147483647.0, _mm_cvtsd_si64(_mm_set_sd(a)))
+TO_INT(fcvt_l_d, double, D64, int64_t, -0x1p63, 0x1p63,       _mm_cvtsd_si64(_mm_set_sd(a)))
+TO_INT(fcvt_w_s, float,  S32, int32_t, -0x1p31f, 0x1p31f,     _mm_cvtss_si64(_mm_set_ss(a)))
+TO_INT(fcvt_l_s, float,  S32, int64_t, -0x1p63f, 0x1p63f,     _mm_cvtss_si64(_mm_set_ss(a)))
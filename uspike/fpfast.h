@@ -0,0 +1,25 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+// Floating point instructions using host SSE arithmetic when results
+// are bit-identical to Spike softfloat, otherwise calling golden[].
+// Exception flags accumulate in host MXCSR until fp_sync() folds them
+// into fflags, which must happen before the guest can see fflags.
+
+void fp_begin();
+void fp_sync(class processor_t* p);
+
+#define FP_FAST(name)  void F_##name(Insn_t i, long pc, mmu_t& MMU, class processor_t* p)
+
+FP_FAST(fadd_d);   FP_FAST(fsub_d);   FP_FAST(fmul_d);   FP_FAST(fdiv_d);
+FP_FAST(fadd_s);   FP_FAST(fsub_s);   FP_FAST(fmul_s);   FP_FAST(fdiv_s);
+FP_FAST(fsqrt_d);  FP_FAST(fsqrt_s);
+FP_FAST(fmin_d);   FP_FAST(fmax_d);   FP_FAST(fmin_s);   FP_FAST(fmax_s);
+FP_FAST(fmadd_d);  FP_FAST(fmsub_d);  FP_FAST(fnmsub_d); FP_FAST(fnmadd_d);
+FP_FAST(fmadd_s);  FP_FAST(fmsub_s);  FP_FAST(fnmsub_s); FP_FAST(fnmadd_s);
+FP_FAST(feq_d);    FP_FAST(flt_d);    FP_FAST(fle_d);
+FP_FAST(feq_s);    FP_FAST(flt_s);    FP_FAST(fle_s);
+FP_FAST(fcvt_d_s); FP_FAST(fcvt_s_d);
+FP_FAST(fcvt_d_w); FP_FAST(fcvt_d_l); FP_FAST(fcvt_s_w); FP_FAST(fcvt_s_l);
+FP_FAST(fcvt_w_d); FP_FAST(fcvt_l_d); FP_FAST(fcvt_w_s); FP_FAST(fcvt_l_s);
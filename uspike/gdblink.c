@@ -23,6 +23,15 @@ int lastGdbSignal = 0;
 long *gdb_pc;
 long *gdb_reg;
 long gdbNumContinue = -1;	/* program started by 'c' */
+int gdbSingleStep = 0;		/* last command was 's' */
+
+int gdbWatchType = 0;		/* 2=write, 3=read, 4=access watchpoint hit */
+long gdbWatchAddr;
+
+int insert_breakpoint(long pc);
+int remove_breakpoint(long pc);
+int insert_watchpoint(long addr, long len, int type);
+int remove_watchpoint(long addr, long len, int type);
 
 #define INBUFSIZE    ((NUMREGS+1)*16 + 100)
 #define OUTBUFSIZE   ((NUMREGS+1)*16 + 100)
@@ -429,6 +438,7 @@ ProcessGdbCommand() {
     case 's':			// Single step.
       {
         //pr9intf("GDB_COMMAND: s\n");
+	gdbSingleStep = 1;
 	long addr;
 	if (*inPtr == '\0')
 	  return;		// Continue at current pc.
@@ -445,6 +455,7 @@ ProcessGdbCommand() {
       //printf("GDB_COMMAND: c\n");
       {
 	++gdbNumContinue;
+	gdbSingleStep = 0;
 	long addr;
 	if (*inPtr == '\0')
 	  return;		// Continue at current pc.
@@ -457,6 +468,31 @@ ProcessGdbCommand() {
       }
       break;
 
+    case 'Z':			// Zt,AA..AA,K - insert breakpoint or watchpoint type t
+    case 'z':			// zt,AA..AA,K - remove it
+      {
+	int insert = inPtr[-1] == 'Z';
+	long type, addr, kind;
+	if (RcvHexInt(&type) && *inPtr++ == ',' && RcvHexInt(&addr) && *inPtr++ == ',' && RcvHexInt(&kind)) {
+	  if (type == 0 || type == 1) {	// software or hardware, same to us
+	    if (insert ? insert_breakpoint(addr) : remove_breakpoint(addr))
+	      Reply("OK");
+	    else
+	      Reply("E03");
+	  }
+	  else if (type <= 4) {	// kind is length for watchpoints
+	    if (insert ? insert_watchpoint(addr, kind, type) : remove_watchpoint(addr, kind, type))
+	      Reply("OK");
+	    else
+	      Reply("E03");
+	  }
+	  /* other types unsupported, empty reply */
+	}
+	else
+	  Reply("E01");
+      }
+      break;
+
     } /* switch */
     SendPacket();		// Resets outPtr to beginning of outBuffer.
   } /* for (;;) */
@@ -472,8 +508,14 @@ void signal_handler(int nSIGnum)
 
 void ProcessGdbException()
 {
+  static const char* watch[] = { "watch:", "rwatch:", "awatch:" };
   Reply("T");
   ReplyInt(lastGdbSignal, 1);	// signal number
+  if (gdbWatchType) {
+    Reply(watch[gdbWatchType-2]);
+    ReplyInt(gdbWatchAddr, 8);
+    Reply(";");
+  }
   Reply("20:");			// PC is register #32
   ReplyInHex((void*)gdb_pc, 8);
   Reply(";");
@@ -1,9 +1,14 @@
 #include <unistd.h>
 #include <stdlib.h>
+#include <malloc.h>
+#include <new>
 #include <stdio.h>
 #include <signal.h>
+#include <sched.h>
+#include <dirent.h>
 #include <sys/syscall.h>
 #include <linux/futex.h>
+#include <linux/mempolicy.h>
 
 #include "options.h"
 #include "uspike.h"
@@ -11,10 +16,94 @@
 #include "mmu.h"
 #include "hart.h"
 
+option<>     conf_cpus("cpus",	0,			"Pin host threads round robin to host CPUs, eg 0-7,16-23");
+option<bool> conf_numa("numa",	false, true,		"Move per-thread state to NUMA node of its host CPU");
+
 volatile hart_t* hart_t::cpu_list =0;
-volatile long hart_t::total_insns =0;
 volatile int hart_t::num_threads =0;
 
+static int host_cpus[CPU_SETSIZE];
+static int num_host_cpus;	// parsed on first call, from main thread
+
+static int host_cpu(int n)
+{
+  if (!conf_cpus)
+    return -1;
+  if (num_host_cpus == 0) {
+    const char* s = conf_cpus;
+    while (*s) {
+      char* end;
+      long lo = strtol(s, &end, 10);
+      long hi = lo;
+      dieif(end==s, "--cpus=%s is not a list of CPU ranges", (const char*)conf_cpus);
+      if (*end == '-') {
+	s = end+1;
+	hi = strtol(s, &end, 10);
+	dieif(end==s || hi<lo, "--cpus=%s has bad range", (const char*)conf_cpus);
+      }
+      for (long c=lo; c<=hi && num_host_cpus<CPU_SETSIZE; c++)
+	host_cpus[num_host_cpus++] = c;
+      dieif(*end && *end!=',', "--cpus=%s is not a list of CPU ranges", (const char*)conf_cpus);
+      s = *end ? end+1 : end;
+    }
+    dieif(num_host_cpus==0, "--cpus list is empty");
+  }
+  return host_cpus[n % num_host_cpus];
+}
+
+static int cpu_node(int cpu)
+{
+  char dirname[64];
+  snprintf(dirname, sizeof dirname, "/sys/devices/system/cpu/cpu%d", cpu);
+  DIR* dir = opendir(dirname);
+  int node = -1;
+  if (dir) {
+    while (struct dirent* d = readdir(dir))
+      if (sscanf(d->d_name, "node%d", &node) == 1)
+	break;
+    closedir(dir);
+  }
+  return node;
+}
+
+int pin_thread(int n)
+{
+  int cpu = host_cpu(n);
+  if (cpu < 0)
+    return -1;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  dieif(sched_setaffinity(0, sizeof set, &set) < 0, "Cannot pin thread to host CPU %d", cpu);
+  return conf_numa ? cpu_node(cpu) : -1;
+}
+
+// Objects are page_alloc()ed, or their neighbours would move too
+void numa_move(const volatile void* addr, long bytes, int node)
+{
+  if (node < 0 || bytes <= 0)
+    return;
+  long lo = (long)addr & ~4095L;
+  long hi = ((long)addr + bytes + 4095) & ~4095L;
+  unsigned long mask[4] = { 0 };
+  if (node >= 8*(int)sizeof mask)
+    return;
+  mask[node/64] = 1UL << node%64;
+  syscall(SYS_mbind, lo, hi-lo, MPOL_PREFERRED, mask, 8*sizeof mask, MPOL_MF_MOVE);
+}
+
+void* page_alloc(long bytes)
+{
+  void* p = memalign(4096, (bytes+4095) & ~4095L);
+  dieif(!p, "Cannot allocate %ld bytes", bytes);
+  return p;
+}
+
+void hart_t::operator delete(void* p)
+{
+  free(p);
+}
+
 hart_t* hart_t::find(int tid)
 {
   for (hart_t* p=list(); p; p=p->link)
@@ -23,13 +112,12 @@ hart_t* hart_t::find(int tid)
   return 0;
 }
 
-void hart_t::incr_count(long n)
+long hart_t::total_count()
 {
-  _executed += n;
-  long oldtotal;
-  do {
-    oldtotal = total_insns;
-  } while (!__sync_bool_compare_and_swap(&total_insns, oldtotal, oldtotal+n));
+  long total = 0;
+  for (hart_t* p=list(); p; p=p->link)
+    total += p->executed();
+  return total;
 }
 
 #ifdef DEBUG
@@ -91,54 +179,45 @@ void signal_handler(int nSIGnum, siginfo_t* si, void* vcontext)
 
 #include "spike_link.h"
 
-long hart_t::read_reg(int n)
+processor_t* hart_t::make_spike()
 {
-  processor_t* p = spike();
-  return READ_REG(n);
-}
-
-void hart_t::write_reg(int n, long value)
-{
-  processor_t* p = spike();
-  WRITE_REG(n, value);
-}
-
-long* hart_t::reg_file()
-{
-  processor_t* p = spike();
-  //return (long*)&(p->get_state()->XPR);
-  return (long*)&p->get_state()->XPR[0];
-}
-
-long hart_t::read_pc()
-{
-  processor_t* p = spike();
-  return STATE.pc;
-}
-
-void hart_t::write_pc(long value)
-{
-  processor_t* p = spike();
-  STATE.pc = value;
+  processor_t* p = new (page_alloc(sizeof(processor_t))) processor_t(conf_isa, "mu", conf_vec, 0, 0, false, stdout);
+  STATE.prv = PRV_U;
+  STATE.mstatus |= (MSTATUS_FS|MSTATUS_VS);
+  STATE.vsstatus |= SSTATUS_FS;
+  long* xpr = (long*)&STATE.XPR[0];
+  memcpy(xpr, _regs.x, sizeof _regs.x);
+  _xpr = xpr;
+  spike_cpu = p;
+  numa_move(p, sizeof(processor_t), _node);
+  return p;
 }
 
-long* hart_t::ptr_pc()
+// The processor_t usually does not exist yet, make_spike() moves it
+void hart_t::place(int node)
 {
-  processor_t* p = spike();
-  return (long*)&STATE.pc;
+  _node = node;
+  numa_move(this, sizeof *this, node);
+  if (spike_cpu)
+    numa_move(spike_cpu, sizeof(processor_t), node);
 }
 
 hart_t::hart_t(mmu_t* m)
 {
-  processor_t* p = new processor_t(conf_isa, "mu", conf_vec, 0, 0, false, stdout);
-  STATE.prv = PRV_U;
-  STATE.mstatus |= (MSTATUS_FS|MSTATUS_VS);
-  STATE.vsstatus |= SSTATUS_FS;
-  STATE.pc = code.entry();
+  memset(&_regs, 0, sizeof _regs);
+  _regs.pc = code.entry();
+  _xpr = _regs.x;
+  spike_cpu = 0;
+  _node = -1;
   my_tid = gettid();
-  spike_cpu = p;
   caveat_mmu = m;
-  _executed = 0;
+  _executed.n = 0;
+  sched_state = 0;
+  _suspend = false;
+  _worker = 0;
+  sched_next = 0;
+  futex_deadline = 0;
+  clear_tid = 0;
   do {
     link = list();
   } while (!__sync_bool_compare_and_swap(&cpu_list, link, this));
@@ -151,7 +230,13 @@ hart_t::hart_t(mmu_t* m)
 
 hart_t::hart_t(hart_t* from, mmu_t* m) : hart_t(m)
 {
-  memcpy(spike()->get_state(), from->spike()->get_state(), sizeof(state_t));
+  if (from->spike_cpu) {
+    make_spike();
+    memcpy(spike_cpu->get_state(), from->spike_cpu->get_state(), sizeof(state_t));
+  }
+  else
+    memcpy(_regs.x, from->_regs.x, sizeof _regs.x);
+  _regs.pc = from->_regs.pc;
 }
 
 void hart_t::set_tid()
@@ -23,45 +23,82 @@ struct Debug_t {
 };
 #endif
 
+// Written only by the owning thread, alone in a cache line so other
+// threads summing counters never take the line away from the writer.
+struct alignas(64) counter_t {
+  volatile long n;
+};
+
+// Integer registers and pc of a thread running only scalar code.  The
+// Spike processor_t, which holds floating point, vector and CSR state,
+// is created when an instruction first needs it, and x[] moves there.
+struct alignas(64) regs_t {
+  long x[32];
+  long pc;
+};
+
+enum { sched_running=0, sched_blocking, sched_blocked, sched_woken, sched_exited };
+
 class hart_t {
-  class processor_t* spike_cpu;	// opaque pointer to Spike structure
+  regs_t _regs;
+  long* _xpr;			// _regs.x, or XPR in Spike processor_t
+  class processor_t* spike_cpu;	// opaque pointer to Spike structure, 0=none yet
+  class processor_t* make_spike();
+  int _node;			// NUMA node from place(), -1=none
   class mmu_t* caveat_mmu;	// opaque pointer to our MMU
   static volatile hart_t* cpu_list;	// for find() using thread id
   hart_t* link;				// list of hart_t
   int my_tid;				// my Linux thread number
   static volatile int num_threads;	// allocated
   int _number;				// index of this hart
-  static volatile long total_insns;	// instructions executed all threads
-  long _executed;			// executed this thread
+  counter_t _executed;			// executed this thread
   volatile int clone_lock;	// 0=free, 1=locked
+  char* clone_stack;		// of thread being cloned
   friend int thread_interpreter(void* arg);
+  // Scheduling on host workers with --workers (see scheduler.cc)
+  volatile int sched_state;	// sched_running etc.
+  bool _suspend;		// leave host worker after this instruction
+  int _worker;			// host worker running this hart
+  hart_t* sched_next;		// in run queue or futex wait list
+  int* futex_addr;		// waiting on this futex
+  int futex_bitset;
+  long futex_deadline;		// CLOCK_MONOTONIC ns, 0=forever
+  int* clear_tid;		// CLONE_CHILD_CLEARTID address
+  friend struct sched_t;
+  friend struct ckpt_t;		// checkpoint.cc
+  bool sched_syscall(long sysnum);
 public:
   hart_t(mmu_t* m);
   hart_t(hart_t* p, mmu_t* m);
+  static void* operator new(size_t n) { return page_alloc(n); } // for place()
+  static void operator delete(void* p);
   virtual hart_t* newcore() { return new hart_t(this, new mmu_t); }
   virtual void proxy_syscall(long sysnum);
+  virtual void place(int node);	// move per-thread state to NUMA node
   void proxy_ecall(long insns);
   
   static class hart_t* list() { return (class hart_t*)cpu_list; }
   class hart_t* next() { return link; }
   static int threads() { return num_threads; }
   int number() { return _number; }
-  long executed() { return _executed; }
-  void incr_count(long n);
-  static long total_count() { return total_insns; }
+  long executed() { return _executed.n; }
+  void incr_count(long n) { _executed.n += n; }
+  static long total_count();	// sum of all threads
   long tid() { return my_tid; }
+  bool suspended() { return _suspend; }
   void set_tid();
   static hart_t* find(int tid);
-  bool interpreter(long how_many);
+  virtual bool interpreter(long how_many) { return interpreter<mmu_t>(how_many); }
+  template<class M> bool interpreter(long how_many);	// M is concrete memory model
   
-  class processor_t* spike() { return spike_cpu; }
+  class processor_t* spike() { return spike_cpu ? spike_cpu : make_spike(); }
   class mmu_t* mmu() { return caveat_mmu; }
-  long read_reg(int n);
-  void write_reg(int n, long value);
-  long* reg_file();
-  long read_pc();
-  void write_pc(long value);
-  long* ptr_pc();
+  long read_reg(int n) { return _xpr[n]; }
+  void write_reg(int n, long value) { _xpr[n] = value; }
+  long* reg_file() { return _xpr; }	// moves when Spike is created
+  long read_pc() { return _regs.pc; }
+  void write_pc(long value) { _regs.pc = value; }
+  long* ptr_pc() { return &_regs.pc; }
 
   template<class T> bool cas(long pc);
 
@@ -71,3 +108,5 @@ public:
 };
 
 class hart_t* find_cpu(int tid);
+void translate(long pc, struct block_t* b, hart_t* cpu);
+void run_workers(hart_t* first);	// does not return
@@ -3,6 +3,11 @@
 */
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "options.h"
 #include "uspike.h"
@@ -11,6 +16,9 @@
 #include "hart.h"
 #include "elf_loader.h"
 
+option<bool> conf_fuse("fuse",	false, true,			"Fuse common instruction pairs");
+option<>     conf_precache("precache", 0, ".",			"Directory of predecode cache files");
+
 insnSpace_t code;
 
 void insnSpace_t::loadelf(const char* elfname)
@@ -18,16 +26,177 @@ void insnSpace_t::loadelf(const char* elfname)
   _entry = load_elf_binary(elfname, 1);
   _base=low_bound;
   _limit=high_bound;
-  int n = (_limit - _base) / 2;
-  predecoded=new Insn_t[n];
-  memset(predecoded, 0, n*sizeof(Insn_t));
-  // Predecode instruction code segment
-  long pc = _base;
-  while (pc < _limit) {
-    Insn_t i = code.set(pc, decoder(code.image(pc), pc));
-    pc += i.compressed() ? 2 : 4;
+  long n = (_limit - _base) / 2;
+  // Zero-filled by the kernel, pages only materialize when touched
+  predecoded = (Insn_t*)mmap(0, n*sizeof(Insn_t), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+  dieif(predecoded==MAP_FAILED, "Cannot mmap predecoded instructions");
+  blocks = (block_t**)mmap(0, n*sizeof(block_t*), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+  dieif(blocks==MAP_FAILED, "Cannot mmap block table");
+  long pages = (_limit-_base+DECODE_PAGE-1) / DECODE_PAGE;
+  decoded = new bool[pages]();
+  skew = new int8_t[pages+1];
+  memset(skew, -1, pages+1);
+  skew[0] = 0;
+  decode_lock.word = 0;
+  if (conf_precache)
+    use_precache();
+}
+
+// A predecode cache file is one header page followed by the predecoded
+// array of every page, named by a hash of the text segment, its address,
+// the fusion option and the generated decoder of this build.  On a hit the
+// array is mapped copy-on-write over the empty one.
+
+#define PRECACHE_HEADER  4096	/* file offset of array, mmap() aligned */
+
+struct precache_t {
+  uint64_t key;
+  long base;
+  long limit;
+};
+
+static uint64_t precache_key(long base, long limit)
+{
+  uint64_t h = 0xcbf29ce484222325UL;	// FNV-1a, a word at a time
+  auto mix = [&](uint64_t v) { h = (h ^ v) * 0x100000001b3UL; };
+  for (long a=base; a+8<=limit; a+=8)
+    mix(*(uint64_t*)a);
+  for (long a=limit & ~7L; a<limit; a++)
+    mix(*(uint8_t*)a);
+  mix(base);
+  mix(limit);
+  mix(conf_fuse);
+  mix(decoder_fingerprint);	// of generated decoder.h and constants.h
+  return h;
+}
+
+void insnSpace_t::use_precache()
+{
+  precache_t hdr = { precache_key(_base, _limit), _base, _limit };
+  long sz = (_limit-_base)/2*sizeof(Insn_t);
+  long pages = (_limit-_base+DECODE_PAGE-1) / DECODE_PAGE;
+  char fname[1024];
+  snprintf(fname, sizeof fname, "%s/uspike-%016lx.pre", (const char*)conf_precache, hdr.key);
+  int fd = open(fname, O_RDONLY);
+  if (fd >= 0) {
+    precache_t file;
+    struct stat st;
+    if (pread(fd, &file, sizeof file, 0) == sizeof file && !memcmp(&file, &hdr, sizeof hdr)
+	&& fstat(fd, &st) == 0 && st.st_size >= PRECACHE_HEADER+sz) {
+      void* m = mmap(predecoded, sz, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED, fd, PRECACHE_HEADER);
+      dieif(m==MAP_FAILED, "Cannot mmap predecode cache %s", fname);
+      for (long pg=0; pg<pages; pg++)
+	decoded[pg] = true;
+      close(fd);
+      return;
+    }
+    close(fd);
+  }
+  // Miss: predecode everything now, then publish the file atomically
+  predecode_all();
+  char tmpname[1040];
+  snprintf(tmpname, sizeof tmpname, "%s.%d", fname, getpid());
+  fd = open(tmpname, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot create predecode cache %s\n", tmpname);
+    return;
+  }
+  bool ok = pwrite(fd, &hdr, sizeof hdr, 0) == sizeof hdr
+    && pwrite(fd, predecoded, sz, PRECACHE_HEADER) == sz;
+  close(fd);
+  if (ok)
+    rename(tmpname, fname);
+  else
+    unlink(tmpname);
+}
+
+void insnSpace_t::predecode_all()
+{
+  long pages = (_limit-_base+DECODE_PAGE-1) / DECODE_PAGE;
+  for (long pg=0; pg<pages; pg++)
+    if (!decoded[pg])
+      decode_page(pg);
+}
+
+// Instruction length from the low bits of the first parcel, without
+// decoding it.  Both page walks and the substitutions step by this.
+static long length(long pc)
+{
+  return (*(uint16_t*)pc & 0x3) == 0x3 ? 4 : 2;
+}
+
+// Address of the first instruction starting in page pg.  An instruction
+// may straddle the boundary, so walk from the nearest page below whose
+// first instruction is known, remembering every page passed.
+long insnSpace_t::first_insn(long pg)
+{
+  long k = pg;
+  while (skew[k] < 0)
+    k--;
+  long pc = _base + k*DECODE_PAGE + skew[k];
+  while (k < pg) {
+    long next = _base + (++k)*DECODE_PAGE;
+    while (pc < next)
+      pc += length(pc);
+    skew[k] = pc - next;
+  }
+  return pc;
+}
+
+// One page of instructions plus the first few of the next page, so
+// substitute_xxx() can match patterns crossing the page boundary.
+// Only used while holding decode_lock.
+#define LOOKAHEAD  8		/* bytes past page substitutions look at */
+
+static struct window_t {
+  long base;
+  Insn_t insn[(DECODE_PAGE+LOOKAHEAD)/2 + 2];
+  Insn_t at(long pc) { return insn[(pc-base)/2]; }
+  void set(long pc, Insn_t i) { insn[(pc-base)/2] = i; }
+} window;
+
+static void substitute_cas(long lo, long hi);
+static void substitute_fused(long lo, long hi);
+
+void insnSpace_t::decode_page(long pg)
+{
+  decode_lock.lock();
+  if (!decoded[pg]) {
+    long lo = _base + pg*DECODE_PAGE;
+    long hi = lo+DECODE_PAGE < _limit ? lo+DECODE_PAGE : _limit;
+    long end = hi+LOOKAHEAD < _limit ? hi+LOOKAHEAD : _limit;
+    window.base = lo;
+    memset(window.insn, 0, sizeof window.insn);
+    long first = first_insn(pg);
+    long pc = first;
+    for (; pc < hi; pc += length(pc))
+      window.set(pc, decoder(image(pc), pc));
+    skew[pg+1] = pc - hi;
+    for (; pc < end; pc += length(pc))
+      window.set(pc, decoder(image(pc), pc));
+    substitute_cas(first, hi);
+    if (conf_fuse)
+      substitute_fused(first, hi);
+    memcpy(descr(lo), window.insn, (hi-lo)/2*sizeof(Insn_t));
+    // Second halves of pairs in this page are needed now, but the next
+    // page may never be reached.  Executing them unfused is harmless,
+    // except Load-Reserve which must trap to be replaced by cas.
+    if (hi < _limit && !decoded[pg+1]) {
+      for (pc=hi; pc<end; pc+=2) {
+	Insn_t i = window.at(pc);
+	if (i.opcode() != Op_ZERO && i.opcode() != Op_lr_w && i.opcode() != Op_lr_d)
+	  set(pc, i);
+      }
+    }
+    __sync_synchronize();
+    decoded[pg] = true;
   }
-  substitute_cas(_base, _limit);
+  decode_lock.word = 0;
+}
+
+void insnSpace_t::flush_blocks()
+{
+  memset(blocks, 0, (_limit-_base)/2*sizeof(block_t*));
 }
 
 Insn_t reg1insn(Opcode_t code, int8_t rd, int8_t rs1)
@@ -89,13 +258,46 @@ Insn_t decoder(int b, long pc)
 #include "decoder.h"
   
  opcode_found:
+  // hint slti x0,x0,imm marks regions of interest for the memory model
+  if (i.opcode() == Op_slti && i.rd() == 0 && i.rs1() == 0)
+    i = Insn_t(Op_roi, NOREG, i.immed());
   return i;
 }
 
 void redecode(long pc)
 {
-  if (code.valid(pc))
+  if (code.valid(pc)) {
+    code.predecode(pc);		// else page decoding would overwrite us later
     code.set(pc, decoder(code.image(pc), pc));
+    // undo fused pair whose second half was changed
+    if (code.valid(pc-4) && op_insns[code.at(pc-4).opcode()] > 1)
+      code.set(pc-4, decoder(code.image(pc-4), pc-4));
+    code.flush_blocks();
+  }
+}
+
+// A gdb breakpoint replaces the predecoded instruction, not the text,
+// with ebreak, which throws trap_breakpoint out of the interpreter.
+// Removing it decodes the text again.  A breakpoint inside a cas
+// sequence is not seen, because cas executes the whole sequence.
+int insert_breakpoint(long pc)
+{
+  if (!code.valid(pc))
+    return 0;
+  code.predecode(pc);
+  if (code.valid(pc-4) && op_insns[code.at(pc-4).opcode()] > 1)
+    code.set(pc-4, decoder(code.image(pc-4), pc-4));
+  code.set(pc, Insn_t(length(pc)==2 ? Op_c_ebreak : Op_ebreak));
+  code.flush_blocks();
+  return 1;
+}
+
+int remove_breakpoint(long pc)
+{
+  if (!code.valid(pc))
+    return 0;
+  redecode(pc);
+  return 1;
 }
 
 #define LABEL_WIDTH  16
@@ -119,7 +321,7 @@ void labelpc(long pc, FILE* f)
 
 int sdisasm(char* buf, long pc)
 {
-  Insn_t i = code.at(pc);
+  Insn_t i = code.predecode(pc);
   if (i.opcode() == Op_ZERO)
     i = decoder(code.image(pc), pc);
   uint32_t b = code.image(pc);
@@ -148,19 +350,19 @@ void disasm(long pc, const char* end, FILE* f)
   fprintf(f, "%s%s", buffer, end);
 }
 
-void substitute_cas(long lo, long hi)
+static void substitute_cas(long lo, long hi)
 {
   // look for compare-and-swap pattern
   long possible=0, replaced=0;
-  for (long pc=lo; pc<hi; pc+=code.at(pc).compressed()?2:4) {
-    Insn_t i = code.at(pc);
+  for (long pc=lo; pc<hi; pc+=length(pc)) {
+    Insn_t i = window.at(pc);
     if (!(i.opcode() == Op_lr_w || i.opcode() == Op_lr_d))
       continue;
     possible++;
-    Insn_t i2 = code.at(pc+4);
+    Insn_t i2 = window.at(pc+4);
     if (i2.opcode() != Op_bne && i2.opcode() != Op_c_bnez) continue;
     int len = 4 + (i2.opcode()==Op_c_bnez ? 2 : 4);
-    Insn_t i3 = code.at(pc+len);
+    Insn_t i3 = window.at(pc+len);
     if (i3.opcode() != Op_sc_w && i3.opcode() != Op_sc_d) continue;
     // pattern found, check registers
     int load_reg = i.rd();
@@ -174,7 +376,7 @@ void substitute_cas(long lo, long hi)
     Opcode_t op;
     if (len == 8) op = (i.opcode() == Op_lr_w) ? Op_cas12_w : Op_cas12_d;
     else          op = (i.opcode() == Op_lr_w) ? Op_cas10_w : Op_cas10_d;
-    code.set(pc, reg3insn(op, flag_reg, addr_reg, test_reg, newv_reg));
+    window.set(pc, reg3insn(op, flag_reg, addr_reg, test_reg, newv_reg));
     replaced++;
   }
   if (replaced != possible) {
@@ -183,4 +385,42 @@ void substitute_cas(long lo, long hi)
   }
 }
 
+static void substitute_fused(long lo, long hi)
+{
+  // replace common pairs of 32-bit instructions with one fused opcode,
+  // the second instruction remains in place for the fused one to read
+  for (long pc=lo; pc<hi; pc+=length(pc)) {
+    Insn_t i = window.at(pc);
+    Insn_t j = window.at(pc+4);
+    if (i.compressed() || j.compressed() || i.rd() <= 0)
+      continue;
+    long op1 = i.opcode();
+    long op2 = j.opcode();
+    Opcode_t op;
+    if (op1 == Op_lui && (op2 == Op_addi || op2 == Op_addiw)) {
+      if (j.rd() != i.rd() || j.rs1() != i.rd()) continue;
+      op = (op2 == Op_addi) ? Op_lui_addi : Op_lui_addiw;
+      window.set(pc, reg0imm(op, i.rd(), i.immed()));
+    }
+    else if (op1 == Op_auipc && (op2 == Op_jalr || op2 == Op_ld)) {
+      if (j.rs1() != i.rd()) continue;
+      if (op2 == Op_ld && j.rd() == 0) continue;
+      op = (op2 == Op_jalr) ? Op_auipc_jalr : Op_auipc_ld;
+      window.set(pc, reg0imm(op, i.rd(), i.immed()));
+    }
+    else if (op1 == Op_slli && op2 == Op_srli) {
+      if (j.rd() != i.rd() || j.rs1() != i.rd() || j.immed() != i.immed()) continue;
+      window.set(pc, reg1imm(Op_slli_srli, i.rd(), i.rs1(), i.immed()));
+    }
+    else if ((op1 == Op_slt || op1 == Op_sltu) && (op2 == Op_bne || op2 == Op_beq)) {
+      if (j.rs1() != i.rd() || j.rs2() != 0) continue;
+      if (op1 == Op_slt) op = (op2 == Op_bne) ? Op_slt_bne  : Op_slt_beq;
+      else               op = (op2 == Op_bne) ? Op_sltu_bne : Op_sltu_beq;
+      window.set(pc, reg2insn(op, i.rd(), i.rs1(), i.rs2()));
+    }
+    else
+      continue;
+  }
+}
+
 #include "constants.h"
@@ -14,9 +14,9 @@ extern const char* reg_name[];
 // by making sure flag bits are all zero in this case, then just use value.
 
 #define GPREG	0
-#define FPREG	GPREG+32
-#define VPREG	FPREG+32
-#define VMREG	VPREG+32
+#define FPREG	(GPREG+32)
+#define VPREG	(FPREG+32)
+#define VMREG	(VPREG+32)
 #define NOREG	-1
 
 class alignas(8) Insn_t {
@@ -53,11 +53,48 @@ public:
 };
 static_assert(sizeof(Insn_t) == 8);
 
+// Basic blocks of predecoded instructions are built the first time
+// control reaches their starting pc, and executed by the interpreter
+// jumping directly from one handler to the next.  Blocks executed
+// often enough are translated into native code (see translate.cc).
+
+#define MAX_BLOCK  64		/* instructions in longest basic block */
+
+struct threaded_t {
+  void* handler;		// label in hart_t::interpreter
+  Insn_t insn;
+};
+
+typedef long (*native_t)(long* xpr, class hart_t* cpu, long insns);
+
+struct block_t {
+  long length;			// number of entries
+  long insns;			// number of instructions, fused count as several
+  long count;			// times executed, until translated
+  native_t native;		// translated code, or 0
+  bool uses_spike;		// some instruction needs Spike processor_t
+  threaded_t insn[0];		// length entries plus block exit
+};
+
+// The text segment is predecoded one page at a time, the first time
+// control reaches the page.  Entries not yet predecoded are zero, so
+// finding Op_ZERO where an instruction should be calls predecode().
+
+#define DECODE_PAGE  (1<<12)	/* bytes predecoded together */
+
 class insnSpace_t {
   long _base;
   long _limit;
   long _entry;
   class Insn_t* predecoded;
+  block_t** blocks;		// block starting at pc, same index as predecoded
+  volatile bool* decoded;	// page has been predecoded
+  int8_t* skew;			// offset of first instruction in page, -1 unknown
+  spinlock_t decode_lock;
+  long page(long pc) { checkif(valid(pc)); return (pc-_base)/DECODE_PAGE; }
+  long first_insn(long pg);
+  void decode_page(long pg);
+  void use_precache();
 public:  
   void loadelf(const char* elfname);
   long base() { return _base; }
@@ -70,6 +107,12 @@ public:
   Insn_t* descr(long pc) { return &predecoded[index(pc)]; }
   uint32_t image(long pc) { checkif(valid(pc)); return *(uint32_t*)(pc); }
   Insn_t set(long pc, Insn_t i) { predecoded[index(pc)] = i; return i; }
+  Insn_t predecode(long pc) { if (!decoded[page(pc)]) decode_page(page(pc)); return at(pc); }
+  void predecode_all();		// e.g. before fork() so children share it
+  
+  block_t* block(long pc) { return blocks[index(pc)]; }
+  bool set_block(long pc, block_t* b) { return __sync_bool_compare_and_swap(&blocks[index(pc)], 0, b); }
+  void flush_blocks();
 };
 
 /*
@@ -84,8 +127,12 @@ Insn_t reg2imm( Opcode_t code, int8_t rd, int8_t rs1, int8_t rs2, int16_t imm);
 Insn_t decoder(int b, long pc);	// given bitpattern image of in struction
 
 extern insnSpace_t code;
+extern const bool op_ends_block[];
+extern const bool op_uses_spike[];	// needs Spike processor_t
+extern const int8_t op_length[];	// bytes
+extern const int8_t op_insns[];		// >1 if fused
+extern const uint64_t decoder_fingerprint;	// hash of generated decoder
 
-void substitute_cas(long lo, long hi);
 int slabelpc(char* buf, long pc);
 void labelpc(long pc, FILE* f =stderr);
 int sdisasm(char* buf, long pc);
@@ -14,6 +14,7 @@
 #include "mmu.h"
 #include "hart.h"
 #include "spike_link.h"
+#include "interpreter.h"
 
 #define THREAD_STACK_SIZE  (1<<14)
 
@@ -22,6 +23,7 @@ option<>     conf_vec("vec",		"vlen:128,elen:64,slen:128",	"Vector unit paramete
 option<long> conf_stat("stat",		100,				"Status every M instructions");
 option<bool> conf_ecall("ecall",	false, true,			"Show system calls");
 option<bool> conf_quiet("quiet",	false, true,			"No status report");
+option<bool> conf_blocks("blocks",	false, true,			"Threaded dispatch of basic blocks");
 
 
 struct syscall_map_t {
@@ -39,11 +41,12 @@ void status_report()
   if (conf_quiet)
     return;
   double realtime = elapse_time();
-  fprintf(stderr, "\r\33[2K%12ld insns %3.1fs %3.1f MIPS ", hart_t::total_count(), realtime, hart_t::total_count()/1e6/realtime);
+  long total = hart_t::total_count();
+  fprintf(stderr, "\r\33[2K%12ld insns %3.1fs %3.1f MIPS ", total, realtime, total/1e6/realtime);
   if (hart_t::threads() <= 16) {
     char separator = '(';
     for (hart_t* p=hart_t::list(); p; p=p->next()) {
-      fprintf(stderr, "%c%1ld%%", separator, 100*p->executed()/hart_t::total_count());
+      fprintf(stderr, "%c%1ld%%", separator, 100*p->executed()/total);
       separator = ',';
     }
     fprintf(stderr, ")");
@@ -73,67 +76,49 @@ void show(hart_t* cpu, long pc, FILE* f)
   disasm(pc);
 }
 
-template<class T> bool hart_t::cas(long pc)
+block_t* build_block(long pc, void* const* handler, void* block_exit)
 {
-  Insn_t i = code.at(pc);
-  T* ptr = (T*)read_reg(i.rs1());
-  T expect  = read_reg(i.rs2());
-  T replace = read_reg(i.rs3());
-  T oldval = __sync_val_compare_and_swap(ptr, expect, replace);
-  write_reg(code.at(pc+4).rs1(), oldval);
-  if (oldval == expect)  write_reg(i.rd(), 0);	/* sc was successful */
-  return oldval == expect;
+  threaded_t buf[MAX_BLOCK];
+  long n = 0, insns = 0;
+  bool uses_spike = false;
+  while (n < MAX_BLOCK && code.valid(pc)) {
+    Insn_t i = code.predecode(pc);
+    if (i.opcode() == Op_ZERO || i.opcode() == Op_ILLEGAL || i.opcode() == Op_UNKNOWN)
+      break;
+    buf[n].handler = handler[i.opcode()];
+    buf[n++].insn = i;
+    insns += op_insns[i.opcode()];
+    uses_spike |= op_uses_spike[i.opcode()];
+    // x0 is only cleared on block exit, so writing it ends the block too
+    if (op_ends_block[i.opcode()] || i.rd() == 0)
+      break;
+    pc += op_length[i.opcode()];
+  }
+  if (n == 0)
+    return 0;
+  block_t* b = (block_t*)new char[sizeof(block_t) + (n+1)*sizeof(threaded_t)];
+  b->length = n;
+  b->insns = insns;
+  b->count = 0;
+  b->native = 0;
+  b->uses_spike = uses_spike;
+  memcpy(b->insn, buf, n*sizeof(threaded_t));
+  b->insn[n].handler = block_exit;
+  return b;
 }
 
-extern long (*golden[])(long pc, mmu_t& MMU, class processor_t* p);
-
-#define wrd(e)	xpr[i.rd()]=(e)
-#define r1	xpr[i.rs1()]
-#define r2	xpr[i.rs2()]
-#define imm	i.immed()
-#define MMU	(*mmu())
-#define wpc(npc)  pc=MMU.jump_model(npc, pc)
-
-bool hart_t::interpreter(long how_many)
+// Instructions executed in block before reaching ip
+long insns_before(block_t* b, threaded_t* ip)
 {
-  processor_t* p = spike();
-  long* xpr = reg_file();
-  long pc = read_pc();
-  long insns = 0;
-#ifdef DEBUG
-  long oldpc;
-#endif
-  do {
-#ifdef DEBUG
-    dieif(!code.valid(pc), "Invalid PC %lx, oldpc=%lx", pc, oldpc);
-    oldpc = pc;
-    debug.insert(executed()+insns+1, pc);
-#endif
-    mmu()->insn_model(pc);
-    Insn_t i = code.at(pc);
-    switch (i.opcode()) {
-#include "fastops.h"
-    default:
-      try {
-	pc = golden[i.opcode()](pc, *mmu(), spike());
-      } catch (trap_breakpoint& e) {
-	write_pc(pc);
-	incr_count(insns);
-	return true;
-      }
-    } // switch (i.opcode())
-    xpr[0] = 0;
-#ifdef DEBUG
-    i = code.at(oldpc);
-    int rn = i.rd()==NOREG ? i.rs2() : i.rd();
-    debug.addval(i.rd(), read_reg(rn));
-#endif
-  } while (++insns < how_many);
-  write_pc(pc);
-  incr_count(insns);
-  return false;
+  long n = 0;
+  for (threaded_t* p=b->insn; p<ip; p++)
+    n += op_insns[p->insn.opcode()];
+  return n;
 }
 
+// uspike has no memory model
+template bool hart_t::interpreter<mmu_t>(long how_many);
+
 #undef MMU
 long I_ZERO(long pc, mmu_t& MMU, hart_t* cpu)    { die("I_ZERO should never be dispatched!"); }
 long I_ILLEGAL(long pc, mmu_t& MMU, hart_t* cpu) { die("I_ILLEGAL at 0x%lx", pc); }
@@ -0,0 +1,182 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+/*
+  The interpreter is a template on the concrete memory model class M,
+  so that calls to the insn_model(), jump_model() and load/store hooks
+  are resolved at compile time.  uspike instantiates it for mmu_t, whose
+  hooks do nothing and compile away.  A simulator with its own model
+  includes this file after defining the model class and instantiates
+  hart_t::interpreter<M> from its override of hart_t::interpreter().
+  When the model's stop() becomes true the interpreter returns true
+  after the current instruction.
+  Include options.h, uspike.h, instructions.h, mmu.h, hart.h and
+  spike_link.h first.
+*/
+
+#include "fpfast.h"
+#include "vecfast.h"
+
+extern long (*golden[])(long pc, mmu_t& MMU, class processor_t* p);
+extern template bool hart_t::interpreter<mmu_t>(long how_many);
+block_t* build_block(long pc, void* const* handler, void* block_exit);
+long insns_before(block_t* b, threaded_t* ip);
+
+template<class T> bool hart_t::cas(long pc)
+{
+  Insn_t i = code.at(pc);
+  T* ptr = (T*)read_reg(i.rs1());
+  T expect  = read_reg(i.rs2());
+  T replace = read_reg(i.rs3());
+  T oldval = __sync_val_compare_and_swap(ptr, expect, replace);
+  write_reg(code.at(pc+4).rs1(), oldval);
+  if (oldval == expect)  write_reg(i.rd(), 0);	/* sc was successful */
+  return oldval == expect;
+}
+
+#define wrd(e)	xpr[i.rd()]=(e)
+#define r1	xpr[i.rs1()]
+#define r2	xpr[i.rs2()]
+#define imm	i.immed()
+#define MMU	model
+#define wpc(npc)  pc=MMU.jump_model(npc, pc)
+#define fr1	READ_FREG(i.rs1()-FPREG)
+#define fr2	READ_FREG(i.rs2()-FPREG)
+#define wfd(e)	WRITE_FREG(i.rd()-FPREG, e)
+#define NEED_SPIKE  if (!p) { p=spike(); xpr=reg_file(); }
+
+#define THREAD_ENTRY  MMU.insn_model(pc);
+#define THREAD_NEXT   if (MMU.stop()) goto thread_stop; ip++; goto *ip->handler
+#define THREAD_EXIT   goto block_exit
+
+template<class M> bool hart_t::interpreter(long how_many)
+{
+  static void* const handler[] = {
+#include "threaded_table.h"
+  };
+  model_t<M> model(mmu());
+  processor_t* p = spike_cpu;	// 0 until some instruction needs it
+  long* xpr = reg_file();
+  long pc = read_pc();
+  long insns = 0;
+  long jit = conf_jit;
+  bool blocks = conf_blocks || jit;
+  fp_begin();
+#ifdef DEBUG
+  long oldpc;
+#endif
+  while (insns < how_many) {
+    if (blocks && code.valid(pc)) {
+      block_t* b = code.block(pc);
+      if (!b && (b=build_block(pc, handler, &&block_exit)) && !code.set_block(pc, b)) {
+	delete[] (char*)b;
+	b = code.block(pc);
+      }
+      if (b && b->insns <= how_many-insns) {
+	if (b->native) {
+	  if (b->uses_spike)
+	    NEED_SPIKE
+	  insns += b->insns;
+	  pc = b->native(xpr, this, insns-1);
+	  xpr[0] = 0;
+	  if (suspended())	// ecall gave up the host worker
+	    break;
+	  if (MMU.stop())	// at end of block, not exactly
+	    break;
+	  continue;
+	}
+	if (jit && __sync_add_and_fetch(&b->count, 1) == jit)
+	  translate(pc, b, this);	// blocks are shared, one hart translates
+	threaded_t* ip = b->insn;
+	long first = insns;
+	insns += b->insns - 1;	// as seen by last instruction in block
+	goto *ip->handler;
+#include "threaded.h"
+      T_golden:
+	THREAD_ENTRY
+	NEED_SPIKE
+	try {
+	  pc = golden[ip->insn.opcode()](pc, *mmu(), p);
+	} catch (trap_breakpoint& e) {
+	  fp_sync(p);
+	  write_pc(pc);
+	  incr_count(first + insns_before(b, ip));
+	  return true;
+	}
+	THREAD_NEXT;
+      T_golden_end:
+	THREAD_ENTRY
+	NEED_SPIKE
+	try {
+	  pc = golden[ip->insn.opcode()](pc, *mmu(), p);
+	} catch (trap_breakpoint& e) {
+	  fp_sync(p);
+	  write_pc(pc);
+	  incr_count(first + insns_before(b, ip));
+	  return true;
+	}
+	THREAD_EXIT;
+      block_exit:
+	xpr[0] = 0;
+	insns++;
+	if (MMU.stop())
+	  break;
+	continue;
+      thread_stop:
+	insns = first + insns_before(b, ip+1);
+	break;
+      }
+    }
+#ifdef DEBUG
+    dieif(!code.valid(pc), "Invalid PC %lx, oldpc=%lx", pc, oldpc);
+    oldpc = pc;
+    debug.insert(executed()+insns+1, pc);
+#endif
+    MMU.insn_model(pc);
+    Insn_t i = code.at(pc);
+    if (i.opcode() == Op_ZERO)	// first time in this page
+      i = code.predecode(pc);
+    switch (i.opcode()) {
+#include "fastops.h"
+    default:
+      NEED_SPIKE
+      try {
+	pc = golden[i.opcode()](pc, *mmu(), p);
+      } catch (trap_breakpoint& e) {
+	fp_sync(p);
+	write_pc(pc);
+	incr_count(insns);
+	return true;
+      }
+    } // switch (i.opcode())
+    xpr[0] = 0;
+#ifdef DEBUG
+    i = code.at(oldpc);
+    int rn = i.rd()==NOREG ? i.rs2() : i.rd();
+    debug.addval(i.rd(), read_reg(rn));
+#endif
+    insns++;
+    if (MMU.stop())
+      break;
+  }
+  if (p)
+    fp_sync(p);
+  write_pc(pc);
+  incr_count(insns);
+  return MMU.stop();		// memory model wants control back
+}
+
+#undef wrd
+#undef r1
+#undef r2
+#undef imm
+#undef MMU
+#undef wpc
+#undef fr1
+#undef fr2
+#undef wfd
+#undef NEED_SPIKE
+#undef THREAD_ENTRY
+#undef THREAD_NEXT
+#undef THREAD_EXIT
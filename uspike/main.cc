@@ -5,15 +5,22 @@
 #include <errno.h>
 #include <signal.h>
 #include <setjmp.h>
+#include <sys/syscall.h>
 
 #include "options.h"
 #include "uspike.h"
 #include "instructions.h"
 #include "mmu.h"
 #include "hart.h"
+#include "trace.h"
+#include "arena.h"
 
-option<long> conf_show("show",		0, 				"Trace execution after N gdb continue");
+option<long> conf_show("show",		0, 				"Trace execution after N gdb continue, 0=never");
 option<>     conf_gdb("gdb",		0, "localhost:1234", 		"Remote GDB on socket");
+extern option<> conf_bbv;
+extern option<> conf_trace;
+
+hart_t* bbv_hart();		// bbv.cc
 
 void exit_func()
 {
@@ -21,6 +28,8 @@ void exit_func()
   fprintf(stderr, "EXIT_FUNC() called\n\n");
   status_report();
   fprintf(stderr, "\n");
+  if (conf_mstats)
+    malloc_stats();
 }  
 
 extern "C" {
@@ -33,8 +42,145 @@ extern "C" {
   extern long *gdb_pc;
   extern long *gdb_reg;
   extern long gdbNumContinue;
+  extern int gdbSingleStep;
+  extern int gdbWatchType;
+  extern long gdbWatchAddr;
+};
+
+/*
+  gdb watchpoints are checked by the load and store hooks of the memory
+  model used with --gdb.  A bitmap indexed by a hash of the page number
+  rejects almost every access; only accesses to a page that may hold a
+  watched range search the list.
+*/
+#define WATCH_FILTER_LG  12	/* bits in filter */
+#define MAX_WATCH  16
+
+struct watch_t {
+  long lo, hi;
+  int type;			// 2=write, 3=read, 4=access, as in Z packet
+};
+
+static watch_t watches[MAX_WATCH];
+static int num_watches;
+static uint64_t watch_filter[(1<<WATCH_FILTER_LG)/64];
+
+static long filter_bit(long a)
+{
+  return (a>>12) * 0x9E3779B97F4A7C15UL >> (64-WATCH_FILTER_LG);
+}
+
+static void rebuild_filter()
+{
+  memset(watch_filter, 0, sizeof watch_filter);
+  for (int k=0; k<num_watches; k++)
+    for (long pg=watches[k].lo>>12; pg<=(watches[k].hi-1)>>12; pg++) {
+      long b = filter_bit(pg<<12);
+      watch_filter[b/64] |= 1UL << b%64;
+    }
+}
+
+class gdb_mmu_t : public mmu_t {
+  void check(long a, int size, int type);
+public:
+  int hit_type;			// 0=no watchpoint hit
+  long hit_addr;
+  gdb_mmu_t() { hit_type = 0; }
+  bool filter(long a) { long b=filter_bit(a); return watch_filter[b/64] >> b%64 & 1; }
+  bool filter(long a, int size) { return filter(a) || filter(a+size-1); } // may cross page
+  long load_model( long a, long pc, int size) { if (filter(a, size)) check(a, size, 3); return a; }
+  long store_model(long a, long pc, int size) { if (filter(a, size)) check(a, size, 2); return a; }
+  void amo_model(  long a, long pc, int size) { if (filter(a, size)) { check(a, size, 3); check(a, size, 2); } }
+  bool stop() { return hit_type != 0; }
+};
+
+void gdb_mmu_t::check(long a, int size, int type)
+{
+  for (int k=0; k<num_watches; k++) {
+    watch_t* w = &watches[k];
+    if (a < w->hi && w->lo < a+size && (w->type == type || w->type == 4)) {
+      hit_type = w->type;
+      hit_addr = a > w->lo ? a : w->lo;
+    }
+  }
+}
+
+class gdb_hart_t : public hart_t {
+public:
+  gdb_hart_t() : hart_t(new gdb_mmu_t) { }
+  gdb_hart_t(gdb_hart_t* p) : hart_t(p, new gdb_mmu_t) { }
+  hart_t* newcore() { return new gdb_hart_t(this); }
+  bool interpreter(long how_many);
+  gdb_mmu_t* watch() { return static_cast<gdb_mmu_t*>(mmu()); }
+};
+
+// With --trace every hart writes its instructions and memory references
+class trace_mmu_t : public mmu_t {
+public:
+  tracer_t* tracer;
+  void insn_model(long pc) { tracer->insn(pc); }
+  long load_model( long a, long pc, int size) { tracer->ref(trace_load,  a, size); return a; }
+  long store_model(long a, long pc, int size) { tracer->ref(trace_store, a, size); return a; }
+  void amo_model(  long a, long pc, int size) { tracer->ref(trace_amo,   a, size); }
+};
+
+class trace_hart_t : public hart_t {
+public:
+  trace_hart_t() : hart_t(new trace_mmu_t) { model()->tracer = new tracer_t(number()); }
+  trace_hart_t(trace_hart_t* p) : hart_t(p, new trace_mmu_t) { model()->tracer = new tracer_t(number()); }
+  hart_t* newcore() { return new trace_hart_t(this); }
+  bool interpreter(long how_many);
+  void proxy_syscall(long sysnum);
+  trace_mmu_t* model() { return static_cast<trace_mmu_t*>(mmu()); }
 };
 
+#include "spike_link.h"
+#include "interpreter.h"
+
+bool gdb_hart_t::interpreter(long how_many)
+{
+  return hart_t::interpreter<gdb_mmu_t>(how_many);
+}
+
+bool trace_hart_t::interpreter(long how_many)
+{
+  return hart_t::interpreter<trace_mmu_t>(how_many);
+}
+
+// Only this thread may flush its buffer, so do it before exit
+void trace_hart_t::proxy_syscall(long sysnum)
+{
+  if (sysnum == SYS_exit || sysnum == SYS_exit_group)
+    model()->tracer->flush();
+  hart_t::proxy_syscall(sysnum);
+}
+
+extern "C" int insert_watchpoint(long addr, long len, int type)
+{
+  if (num_watches == MAX_WATCH || len <= 0)
+    return 0;
+  watch_t* w = &watches[num_watches];
+  w->lo = addr;
+  w->hi = addr + len;
+  w->type = type;
+  num_watches++;
+  rebuild_filter();
+  return 1;
+}
+
+extern "C" int remove_watchpoint(long addr, long len, int type)
+{
+  for (int k=0; k<num_watches; k++) {
+    watch_t* w = &watches[k];
+    if (w->lo == addr && w->hi == addr+len && w->type == type) {
+      *w = watches[--num_watches];
+      rebuild_filter();
+      return 1;
+    }
+  }
+  return 0;
+}
+
 
 int main(int argc, const char* argv[], const char* envp[])
 {
@@ -44,8 +190,16 @@ int main(int argc, const char* argv[], const char* envp[])
   start_time();
   code.loadelf(argv[0]);
   long sp = initialize_stack(argc, argv, envp);
-  hart_t* mycpu = new hart_t(new mmu_t());
+  int node = pin_thread(0);
+  dieif((conf_gdb!=0) + (conf_bbv!=0) + (conf_trace!=0) > 1, "Only one of --gdb, --bbv and --trace can be used");
+  dieif(conf_gdb && conf_jit, "--gdb cannot be used with --jit, watchpoints would stop only at block end");
+  if (conf_trace)
+    trace_setup();
+  hart_t* mycpu = conf_gdb ? new gdb_hart_t() : conf_bbv ? bbv_hart() : conf_trace ? new trace_hart_t() : new hart_t(new mmu_t());
+  if (node >= 0)
+    mycpu->place(node);
   mycpu->write_reg(2, sp);	// x2 is stack pointer
+  checkpoint_setup(mycpu);
 
   //#ifdef DEBUG
 #if 0
@@ -68,6 +222,7 @@ int main(int argc, const char* argv[], const char* envp[])
   dieif(atexit(exit_func), "atexit failed");
   //  enum stop_reason reason;
   if (conf_gdb) {
+    mycpu->spike();		// so registers do not move under gdb
     gdb_pc = mycpu->ptr_pc();
     gdb_reg = mycpu->reg_file();
     OpenTcpLink(conf_gdb);
@@ -81,72 +236,34 @@ int main(int argc, const char* argv[], const char* envp[])
       if (setjmp(mainGdbJmpBuf))
 	ProcessGdbException();
       ProcessGdbCommand();
-#if 1
+      // Breakpoints are ebreak in the predecoded text, so continue runs
+      // whole quanta until interpreter() reports one was reached
+      bool tracing = conf_show && gdbNumContinue > conf_show;
+      long quantum = (gdbSingleStep || tracing) ? 1 : conf_stat*1000000L;
+      gdb_mmu_t* model = static_cast<gdb_hart_t*>(mycpu)->watch();
+      model->hit_type = 0;
       while (1) {
 	long oldpc = mycpu->read_pc();
-	if (!mycpu->interpreter(1))
+	bool trapped = mycpu->interpreter(quantum);
+	if (trapped || gdbSingleStep)
 	  break;
-	if (gdbNumContinue > conf_show)
+	if (tracing)
 	  show(mycpu, oldpc);
       }
-#else
-      while (mycpu->single_step())
-	/* pass */ ;
-#endif
+      gdbWatchType = model->hit_type;
+      gdbWatchAddr = model->hit_addr;
       lastGdbSignal = SIGTRAP;
       ProcessGdbException();
     }
   }
   else {
+    if (conf_workers)
+      run_workers(mycpu);
     while (1) {
-      mycpu->interpreter(conf_stat*1000000L);
+      mycpu->interpreter(checkpoint_quantum(conf_stat*1000000L));
+      checkpoint_poll();
       status_report();
     }
   }
   return 0;
 }
-
-extern "C" {
-
-#define poolsize  (1<<30)	/* size of simulation memory pool */
-
-static char simpool[poolsize];	/* base of memory pool */
-static volatile char* pooltop = simpool; /* current allocation address */
-
-void *malloc(size_t size)
-{
-  char volatile *rv, *newtop;
-  do {
-    volatile char* after = pooltop + size + 16; /* allow for alignment */
-    if (after > simpool+poolsize) {
-      fprintf(stderr, " failed\n");
-      return 0;
-    }
-    rv = pooltop;
-    newtop = (char*)((unsigned long)after & ~0xfL); /* always align to 16 bytes */
-  } while (!__sync_bool_compare_and_swap(&pooltop, rv, newtop));
-      
-  return (void*)rv;
-}
-
-void free(void *ptr)
-{
-  /* we don't free stuff */
-}
-
-void *calloc(size_t nmemb, size_t size)
-{
-  return malloc(nmemb * size);
-}
-
-void *realloc(void *ptr, size_t size)
-{
-  return 0;
-}
-
-void *reallocarray(void *ptr, size_t nmemb, size_t size)
-{
-  return 0;
-}
-
-};
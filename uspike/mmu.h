@@ -4,38 +4,38 @@
 #ifndef MMU_H
 #define MMU_H
 
-class mmu_t {
-  virtual long load_model( long a, long pc) { return a; }
-  virtual long store_model(long a, long pc) { return a; }
-  virtual void amo_model(  long a, long pc) { }
-  
+/*
+  Memory accesses as seen by instruction semantics, calling the model
+  hooks of class H.  Through mmu_t they are virtual functions, which is
+  what the golden[] Spike handlers see.  The interpreter is compiled
+  for each concrete model M and accesses memory through model_t<M>, so
+  its hooks are called directly and can be inlined.
+*/
+template<class H> class mmu_ops_t {
+  H* h() { return static_cast<H*>(this); }
  public:
-  mmu_t() { }
-  virtual void insn_model(long pc) { }
-  virtual long jump_model(long npc, long pc) { return npc; }
+  uint8_t  load_uint8( long a, long pc) { return *(uint8_t* )h()->load_model(a, pc, 1); }
+  uint16_t load_uint16(long a, long pc) { return *(uint16_t*)h()->load_model(a, pc, 2); }
+  uint32_t load_uint32(long a, long pc) { return *(uint32_t*)h()->load_model(a, pc, 4); }
+  uint64_t load_uint64(long a, long pc) { return *(uint64_t*)h()->load_model(a, pc, 8); }
 
-  uint8_t  load_uint8( long a, long pc) { return *(uint8_t* )load_model(a, pc); }
-  uint16_t load_uint16(long a, long pc) { return *(uint16_t*)load_model(a, pc); }
-  uint32_t load_uint32(long a, long pc) { return *(uint32_t*)load_model(a, pc); }
-  uint64_t load_uint64(long a, long pc) { return *(uint64_t*)load_model(a, pc); }
-
-  int8_t  load_int8( long a, long pc) { return *(int8_t* )load_model(a, pc); }
-  int16_t load_int16(long a, long pc) { return *(int16_t*)load_model(a, pc); }
-  int32_t load_int32(long a, long pc) { return *(int32_t*)load_model(a, pc); }
-  int64_t load_int64(long a, long pc) { return *(int64_t*)load_model(a, pc); }
+  int8_t  load_int8( long a, long pc) { return *(int8_t* )h()->load_model(a, pc, 1); }
+  int16_t load_int16(long a, long pc) { return *(int16_t*)h()->load_model(a, pc, 2); }
+  int32_t load_int32(long a, long pc) { return *(int32_t*)h()->load_model(a, pc, 4); }
+  int64_t load_int64(long a, long pc) { return *(int64_t*)h()->load_model(a, pc, 8); }
 
   float  load_fp32(long a, long pc) { return ( float)load_int32(a, pc); }
   double load_fp64(long a, long pc) { return (double)load_int64(a, pc); }
   
-  void store_uint8( long a, long pc, uint8_t  v) { *(uint8_t* )store_model(a, pc)=v; }
-  void store_uint16(long a, long pc, uint16_t v) { *(uint16_t*)store_model(a, pc)=v; }
-  void store_uint32(long a, long pc, uint32_t v) { *(uint32_t*)store_model(a, pc)=v; }
-  void store_uint64(long a, long pc, uint64_t v) { *(uint64_t*)store_model(a, pc)=v; }
+  void store_uint8( long a, long pc, uint8_t  v) { *(uint8_t* )h()->store_model(a, pc, 1)=v; }
+  void store_uint16(long a, long pc, uint16_t v) { *(uint16_t*)h()->store_model(a, pc, 2)=v; }
+  void store_uint32(long a, long pc, uint32_t v) { *(uint32_t*)h()->store_model(a, pc, 4)=v; }
+  void store_uint64(long a, long pc, uint64_t v) { *(uint64_t*)h()->store_model(a, pc, 8)=v; }
   
-  void store_int8( long a, long pc, int8_t  v) { *(int8_t* )store_model(a, pc)=v; }
-  void store_int16(long a, long pc, int16_t v) { *(int16_t*)store_model(a, pc)=v; }
-  void store_int32(long a, long pc, int32_t v) { *(int32_t*)store_model(a, pc)=v; }
-  void store_int64(long a, long pc, int64_t v) { *(int64_t*)store_model(a, pc)=v; }
+  void store_int8( long a, long pc, int8_t  v) { *(int8_t* )h()->store_model(a, pc, 1)=v; }
+  void store_int16(long a, long pc, int16_t v) { *(int16_t*)h()->store_model(a, pc, 2)=v; }
+  void store_int32(long a, long pc, int32_t v) { *(int32_t*)h()->store_model(a, pc, 4)=v; }
+  void store_int64(long a, long pc, int64_t v) { *(int64_t*)h()->store_model(a, pc, 8)=v; }
   
   void store_fp32(long a, long pc, float  v) { union { float  f; int  i; } x; x.f=v; store_int32(a, pc, x.i); }
   void store_fp64(long a, long pc, double v) { union { double d; long l; } x; x.d=v; store_int64(a, pc, x.l); }
@@ -44,14 +44,14 @@ class mmu_t {
     uint32_t lhs, *ptr = (uint32_t*)a;
     do lhs = *ptr;
     while (!__sync_bool_compare_and_swap(ptr, lhs, f(lhs)));
-    amo_model(a, pc);
+    h()->amo_model(a, pc, 4);
     return lhs;
   }
   template<typename op>	uint64_t amo_uint64(long a, long pc, op f) {
     uint64_t lhs, *ptr = (uint64_t*)a;
     do lhs = *ptr;
     while (!__sync_bool_compare_and_swap(ptr, lhs, f(lhs)));
-    amo_model(a, pc);
+    h()->amo_model(a, pc, 8);
     return lhs;
   }
 
@@ -62,6 +62,35 @@ class mmu_t {
   void flush_tlb() { }
 };
 
+class mmu_t : public mmu_ops_t<mmu_t> {
+  virtual long load_model( long a, long pc, int size) { return a; }
+  virtual long store_model(long a, long pc, int size) { return a; }
+  virtual void amo_model(  long a, long pc, int size) { }
+  friend class mmu_ops_t<mmu_t>;
+  template<class M> friend class model_t;
+  
+ public:
+  mmu_t() { }
+  virtual void insn_model(long pc) { }
+  virtual long jump_model(long npc, long pc) { return npc; }
+  virtual void roi_model(long what, long pc) { }	// slti x0,x0,what marker
+  bool stop() { return false; }	// interpreter returns after this instruction
+};
+
+template<class M> class model_t : public mmu_ops_t<model_t<M>> {
+  M* m;
+ public:
+  model_t(mmu_t* p) : m(static_cast<M*>(p)) { }
+  long load_model( long a, long pc, int size) { return m->M::load_model(a, pc, size); }
+  long store_model(long a, long pc, int size) { return m->M::store_model(a, pc, size); }
+  void amo_model(  long a, long pc, int size) { m->M::amo_model(a, pc, size); }
+  void insn_model(long pc) { m->M::insn_model(pc); }
+  long jump_model(long npc, long pc) { return m->M::jump_model(npc, pc); }
+  void roi_model(long what, long pc) { m->M::roi_model(what, pc); }
+  bool stop() { return m->M::stop(); }
+  operator mmu_t&() { return *m; }
+};
+
 #define load_uint8( a)  load_uint8( a, pc)
 #define load_uint16(a)  load_uint16(a, pc)
 #define load_uint32(a)  load_uint32(a, pc)
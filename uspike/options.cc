@@ -13,7 +13,7 @@ template <> void option<>     ::printval() { fprintf(stderr, "%s", value?value:"
 template <> void option<int>  ::setval(const char* v) { if (!v) value=none; else value=atoi(v); }
 template <> void option<int>  ::printval() { fprintf(stderr, "%d", value); }
 
-template <> void option<long> ::setval(const char* v) { if (!v) value=none; else value=atoi(v); }
+template <> void option<long> ::setval(const char* v) { if (!v) value=none; else value=atol(v); }
 template <> void option<long> ::printval() { fprintf(stderr, "%ld", value); }
 
 template <> void option<bool> ::setval(const char* v) { if (!v) value=none; else help_exit(); }
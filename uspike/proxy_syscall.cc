@@ -23,8 +23,10 @@
 
 #include "options.h"
 #include "uspike.h"
+#include "instructions.h"
 #include "mmu.h"
 #include "hart.h"
+#include "fpfast.h"
 
 #include "elf_loader.h"
 
@@ -110,6 +112,7 @@ void hart_t::proxy_ecall(long insns)
 int thread_interpreter(void* arg)
 {
   hart_t* oldcpu = (hart_t*)arg;
+  char* stack = oldcpu->clone_stack;
   hart_t* newcpu = oldcpu->newcore();
   newcpu->write_reg(2, newcpu->read_reg(11)); // a1 = child_stack
   newcpu->write_reg(4, newcpu->read_reg(13)); // a3 = tls
@@ -118,6 +121,11 @@ int thread_interpreter(void* arg)
   newcpu->set_tid();
   oldcpu->clone_lock = 0;
   futex(&oldcpu->clone_lock, FUTEX_WAKE, 1);
+  int node = pin_thread(newcpu->number());
+  if (node >= 0) {
+    numa_move(stack, THREAD_STACK_SIZE, node);
+    newcpu->place(node);
+  }
   while (1) {
     newcpu->interpreter(conf_stat*1000000L);
     status_report();
@@ -127,6 +135,8 @@ int thread_interpreter(void* arg)
 
 void hart_t::proxy_syscall(long sysnum)
 {
+  if (conf_workers && sched_syscall(sysnum))
+    return;
   long a0=read_reg(10), a1=read_reg(11), a2=read_reg(12), a3=read_reg(13), a4=read_reg(14), a5=read_reg(15);
   long retval=0;
   switch (sysnum) {
@@ -136,14 +146,37 @@ void hart_t::proxy_syscall(long sysnum)
   case SYS_clone:
     {
       char* interp_stack = new char[THREAD_STACK_SIZE];
+      clone_stack = interp_stack;
       interp_stack += THREAD_STACK_SIZE; // grows down
       long flags = a0 & ~CLONE_SETTLS; // not implementing TLS in interpreter yet
+      if (spike_cpu)
+	fp_sync(spike_cpu);	       // child copies fflags
       clone_lock = 1;		       // private mutex
       retval = clone(thread_interpreter, interp_stack, flags, this, (void*)a2, (void*)a4);
       while (clone_lock)
 	futex(&clone_lock, FUTEX_WAIT, 1);
     }
     break;
+  case SYS_brk:
+    retval = emulate_brk(a0);
+    break;
+  case SYS_mmap:
+    retval = asm_syscall(sysnum, a0, a1, a2, a3, a4, a5);
+    if ((unsigned long)retval < -4095UL)
+      guest_mapped(retval, a1);
+    break;
+  case SYS_munmap:
+    retval = asm_syscall(sysnum, a0, a1, a2, a3, a4, a5);
+    if (retval == 0)
+      guest_unmapped(a0, a1);
+    break;
+  case SYS_mremap:
+    retval = asm_syscall(sysnum, a0, a1, a2, a3, a4, a5);
+    if ((unsigned long)retval < -4095UL) {
+      guest_unmapped(a0, a1);
+      guest_mapped(retval, a2);
+    }
+    break;
   default:
     retval = asm_syscall(sysnum, a0, a1, a2, a3, a4, a5);
   }
@@ -0,0 +1,481 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "options.h"
+#include "uspike.h"
+#include "instructions.h"
+#include "mmu.h"
+#include "hart.h"
+#include "fpfast.h"
+
+option<int>  conf_workers("workers",	0,				"Host threads running all guest threads, 0=one each");
+option<long> conf_quantum("quantum",	100000,				"Instructions per turn on a host worker");
+
+/*
+  With --workers=N guest threads are not host threads.  Harts run on
+  N host workers for a quantum at a time, then go back on a run queue.
+  A worker takes harts from its own queue, or steals from the others
+  when it is empty.  Guest futexes are emulated, so a waiting hart
+  gives up its worker instead of blocking it.  clone, exit, gettid,
+  set_tid_address and sched_yield are emulated to match.  Any other
+  system call that blocks still blocks its worker.
+
+  A checkpoint is written when every worker has parked between quanta,
+  so every hart is either on a run queue or waiting on a futex.
+*/
+
+#define WORKER_STACK_SIZE  (1<<16)
+#define FUTEX_BUCKETS      256	/* power of two */
+#define IDLE_WAIT_NS       1000000
+
+#define host_futex(a, b, c, t)  syscall(SYS_futex, a, b, c, t, 0, 0)
+
+struct alignas(64) runq_t {
+  spinlock_t lock;
+  hart_t* head;
+  hart_t* tail;
+};
+
+struct alignas(64) bucket_t {
+  spinlock_t lock;
+  hart_t* waiters;		// linked through sched_next
+};
+
+static runq_t* runq;
+static bucket_t bucket[FUTEX_BUCKETS];
+static volatile int work_seq;	// bumped when a hart becomes runnable
+static volatile int idle_workers;
+static volatile int timed_waiters;
+static volatile int next_tid;
+static volatile int live_harts;	// process exits with the last one
+static volatile int stopping;	// workers park for a checkpoint
+static volatile int parked;
+
+static long now_ns(clockid_t clock =CLOCK_MONOTONIC)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec*1000000000L + ts.tv_nsec;
+}
+
+struct sched_t {
+  static void enqueue(int w, hart_t* h);
+  static hart_t* dequeue(int w);
+  static void wake(hart_t* h, long retval);
+  static int wake_waiters(int* uaddr, int n, int bitset);
+  static void expire_waiters();
+  static long futex(hart_t* h);
+  static long clone(hart_t* h);
+  static void exit(hart_t* h);
+  static void resume(hart_t* h);
+  static void stop_world();
+  static int worker(void* arg);
+};
+
+void sched_t::enqueue(int w, hart_t* h)
+{
+  runq_t* q = &runq[w];
+  h->sched_next = 0;
+  q->lock.lock();
+  if (q->tail)
+    q->tail->sched_next = h;
+  else
+    q->head = h;
+  q->tail = h;
+  q->lock.unlock();
+  __sync_fetch_and_add(&work_seq, 1);
+  if (idle_workers)
+    host_futex(&work_seq, FUTEX_WAKE_PRIVATE, 1, 0);
+}
+
+hart_t* sched_t::dequeue(int w)
+{
+  for (int k=0; k<conf_workers; k++) {
+    runq_t* q = &runq[(w+k) % conf_workers];
+    if (!q->head)
+      continue;
+    q->lock.lock();
+    hart_t* h = q->head;
+    if (h) {
+      q->head = h->sched_next;
+      if (!q->head)
+	q->tail = 0;
+    }
+    q->lock.unlock();
+    if (h)
+      return h;
+  }
+  return 0;
+}
+
+static bucket_t* bucket_of(int* uaddr)
+{
+  return &bucket[((unsigned long)uaddr >> 2) * 0x9E3779B97F4A7C15UL >> 56 & (FUTEX_BUCKETS-1)];
+}
+
+// Caller has removed h from its wait list.  The hart may not have left
+// its worker yet, in which case that worker puts it back on a run queue.
+void sched_t::wake(hart_t* h, long retval)
+{
+  if (h->futex_deadline)
+    __sync_fetch_and_sub(&timed_waiters, 1);
+  h->write_reg(10, retval);
+  if (__sync_bool_compare_and_swap(&h->sched_state, sched_blocking, sched_woken))
+    return;
+  h->sched_state = sched_running;
+  enqueue(h->_worker, h);
+}
+
+int sched_t::wake_waiters(int* uaddr, int n, int bitset)
+{
+  bucket_t* b = bucket_of(uaddr);
+  hart_t* woken = 0;
+  int count = 0;
+  b->lock.lock();
+  for (hart_t** p=&b->waiters; *p && count<n; ) {
+    hart_t* h = *p;
+    if (h->futex_addr == uaddr && (h->futex_bitset & bitset)) {
+      *p = h->sched_next;
+      h->sched_next = woken;
+      woken = h;
+      count++;
+    }
+    else
+      p = &h->sched_next;
+  }
+  b->lock.unlock();
+  while (woken) {
+    hart_t* h = woken;
+    woken = h->sched_next;
+    wake(h, 0);
+  }
+  return count;
+}
+
+void sched_t::expire_waiters()
+{
+  long now = now_ns();
+  for (int i=0; i<FUTEX_BUCKETS && timed_waiters; i++) {
+    bucket_t* b = &bucket[i];
+    if (!b->waiters)
+      continue;
+    hart_t* expired = 0;
+    b->lock.lock();
+    for (hart_t** p=&b->waiters; *p; ) {
+      hart_t* h = *p;
+      if (h->futex_deadline && h->futex_deadline <= now) {
+	*p = h->sched_next;
+	h->sched_next = expired;
+	expired = h;
+      }
+      else
+	p = &h->sched_next;
+    }
+    b->lock.unlock();
+    while (expired) {
+      hart_t* h = expired;
+      expired = h->sched_next;
+      wake(h, -ETIMEDOUT);
+    }
+  }
+}
+
+// Returns 1 if the hart is now waiting, its a0 has been written already
+long sched_t::futex(hart_t* h)
+{
+  int* uaddr = (int*)h->read_reg(10);
+  int op = h->read_reg(11);
+  int val = h->read_reg(12);
+  long a3 = h->read_reg(13);
+  int* uaddr2 = (int*)h->read_reg(14);
+  int val3 = h->read_reg(15);
+  int cmd = op & FUTEX_CMD_MASK;
+  switch (cmd) {
+  case FUTEX_WAIT:
+  case FUTEX_WAIT_BITSET:
+    {
+      int bitset = (cmd == FUTEX_WAIT) ? FUTEX_BITSET_MATCH_ANY : val3;
+      if (bitset == 0)
+	return -EINVAL;
+      long deadline = 0;
+      if (a3) {
+	struct timespec* ts = (struct timespec*)a3;
+	deadline = ts->tv_sec*1000000000L + ts->tv_nsec;
+	if (cmd == FUTEX_WAIT)
+	  deadline += now_ns();
+	else if (op & FUTEX_CLOCK_REALTIME)
+	  deadline += now_ns() - now_ns(CLOCK_REALTIME);
+	if (deadline <= 0)
+	  deadline = 1;
+      }
+      bucket_t* b = bucket_of(uaddr);
+      b->lock.lock();
+      if (*(volatile int*)uaddr != val) {
+	b->lock.unlock();
+	return -EAGAIN;
+      }
+      h->write_reg(10, 0);
+      h->futex_addr = uaddr;
+      h->futex_bitset = bitset;
+      h->futex_deadline = deadline;
+      if (deadline)
+	__sync_fetch_and_add(&timed_waiters, 1);
+      h->sched_state = sched_blocking;
+      h->_suspend = true;
+      h->sched_next = b->waiters;
+      b->waiters = h;
+      b->lock.unlock();
+      return 1;
+    }
+  case FUTEX_WAKE:
+    return wake_waiters(uaddr, val, FUTEX_BITSET_MATCH_ANY);
+  case FUTEX_WAKE_BITSET:
+    return val3 ? wake_waiters(uaddr, val, val3) : -EINVAL;
+  case FUTEX_REQUEUE:
+  case FUTEX_CMP_REQUEUE:
+    {
+      if (cmd == FUTEX_CMP_REQUEUE && *(volatile int*)uaddr != val3)
+	return -EAGAIN;
+      int n = wake_waiters(uaddr, val, FUTEX_BITSET_MATCH_ANY);
+      // move up to val2 remaining waiters to uaddr2
+      bucket_t* b1 = bucket_of(uaddr);
+      bucket_t* b2 = bucket_of(uaddr2);
+      bucket_t* lo = b1<b2 ? b1 : b2;
+      bucket_t* hi = b1<b2 ? b2 : b1;
+      lo->lock.lock();
+      if (hi != lo)
+	hi->lock.lock();
+      int moved = 0;
+      for (hart_t** p=&b1->waiters; *p && moved<(int)a3; ) {
+	hart_t* h = *p;
+	if (h->futex_addr == uaddr) {
+	  h->futex_addr = uaddr2;
+	  if (b2 != b1) {
+	    *p = h->sched_next;
+	    h->sched_next = b2->waiters;
+	    b2->waiters = h;
+	  }
+	  else
+	    p = &h->sched_next;
+	  moved++;
+	}
+	else
+	  p = &h->sched_next;
+      }
+      if (hi != lo)
+	hi->lock.unlock();
+      lo->lock.unlock();
+      return n + (cmd == FUTEX_CMP_REQUEUE ? moved : 0);
+    }
+  case FUTEX_WAKE_OP:
+    {
+      int wop = (val3 >> 28) & 7;
+      int wcmp = (val3 >> 24) & 15;
+      int oparg = val3 << 8 >> 20;
+      int cmparg = val3 << 20 >> 20;
+      if ((val3 >> 28) & FUTEX_OP_OPARG_SHIFT)
+	oparg = 1 << oparg;
+      int old;
+      switch (wop) {
+      case FUTEX_OP_SET:   old = __sync_lock_test_and_set(uaddr2, oparg);  break;
+      case FUTEX_OP_ADD:   old = __sync_fetch_and_add(uaddr2, oparg);      break;
+      case FUTEX_OP_OR:    old = __sync_fetch_and_or(uaddr2, oparg);       break;
+      case FUTEX_OP_ANDN:  old = __sync_fetch_and_and(uaddr2, ~oparg);     break;
+      case FUTEX_OP_XOR:   old = __sync_fetch_and_xor(uaddr2, oparg);      break;
+      default:  return -ENOSYS;
+      }
+      bool cond;
+      switch (wcmp) {
+      case FUTEX_OP_CMP_EQ:  cond = (old == cmparg);  break;
+      case FUTEX_OP_CMP_NE:  cond = (old != cmparg);  break;
+      case FUTEX_OP_CMP_LT:  cond = (old <  cmparg);  break;
+      case FUTEX_OP_CMP_LE:  cond = (old <= cmparg);  break;
+      case FUTEX_OP_CMP_GT:  cond = (old >  cmparg);  break;
+      case FUTEX_OP_CMP_GE:  cond = (old >= cmparg);  break;
+      default:  return -ENOSYS;
+      }
+      int n = wake_waiters(uaddr, val, FUTEX_BITSET_MATCH_ANY);
+      if (cond)
+	n += wake_waiters(uaddr2, (int)a3, FUTEX_BITSET_MATCH_ANY);
+      return n;
+    }
+  default:
+    die("futex operation %d not supported with --workers", cmd);
+  }
+}
+
+long sched_t::clone(hart_t* h)
+{
+  long flags = h->read_reg(10);
+  if (h->spike_cpu)
+    fp_sync(h->spike_cpu);	// child copies fflags
+  hart_t* child = h->newcore();
+  int tid = __sync_fetch_and_add(&next_tid, 1);
+  child->my_tid = tid;
+  child->write_reg(2, h->read_reg(11)); // a1 = child_stack
+  if (flags & CLONE_SETTLS)
+    child->write_reg(4, h->read_reg(13)); // a3 = tls
+  child->write_reg(10, 0);	// indicating we are child thread
+  child->write_pc(child->read_pc()+4); // skip over ecall instruction
+  if (flags & CLONE_PARENT_SETTID)
+    *(int*)h->read_reg(12) = tid;
+  if (flags & CLONE_CHILD_SETTID)
+    *(int*)h->read_reg(14) = tid;
+  if (flags & CLONE_CHILD_CLEARTID)
+    child->clear_tid = (int*)h->read_reg(14);
+  child->_worker = h->_worker;
+  __sync_fetch_and_add(&live_harts, 1);
+  enqueue(h->_worker, child);
+  return tid;
+}
+
+void sched_t::exit(hart_t* h)
+{
+  if (h->clear_tid) {
+    *h->clear_tid = 0;
+    wake_waiters(h->clear_tid, 1, FUTEX_BITSET_MATCH_ANY);
+  }
+  if (__sync_sub_and_fetch(&live_harts, 1) == 0)
+    ::exit(h->read_reg(10));
+  h->sched_state = sched_exited;
+  h->_suspend = true;
+}
+
+// Emulate system calls that would block or identify the host thread
+bool hart_t::sched_syscall(long sysnum)
+{
+  long retval;
+  switch (sysnum) {
+  case SYS_futex:
+    retval = sched_t::futex(this);
+    if (retval == 1 && _suspend)
+      return true;		// a0 written when woken
+    break;
+  case SYS_clone:
+    if (!(read_reg(10) & CLONE_VM))
+      return false;		// new process, not thread
+    retval = sched_t::clone(this);
+    break;
+  case SYS_exit:
+    sched_t::exit(this);
+    return true;
+  case SYS_gettid:
+    retval = my_tid;
+    break;
+  case SYS_set_tid_address:
+    clear_tid = (int*)read_reg(10);
+    retval = my_tid;
+    break;
+  case SYS_sched_yield:
+    _suspend = true;
+    retval = 0;
+    break;
+  default:
+    return false;
+  }
+  write_reg(10, retval);
+  return true;
+}
+
+// Put a hart that is not running on a worker where it belongs
+void sched_t::resume(hart_t* h)
+{
+  if (h->tid() >= next_tid)
+    next_tid = h->tid() + 1;
+  __sync_fetch_and_add(&live_harts, 1);
+  if (h->sched_state != sched_blocked) {
+    h->sched_state = sched_running;
+    enqueue(0, h);
+    return;
+  }
+  bucket_t* b = bucket_of(h->futex_addr);
+  if (h->futex_deadline)
+    __sync_fetch_and_add(&timed_waiters, 1);
+  b->lock.lock();
+  h->sched_next = b->waiters;
+  b->waiters = h;
+  b->lock.unlock();
+}
+
+// First worker here writes the checkpoint once all others have parked
+void sched_t::stop_world()
+{
+  if (!__sync_bool_compare_and_swap(&stopping, 0, 1)) {
+    __sync_fetch_and_add(&parked, 1);
+    while (stopping)
+      host_futex(&stopping, FUTEX_WAIT_PRIVATE, 1, 0);
+    __sync_fetch_and_sub(&parked, 1);
+    return;
+  }
+  while (parked < conf_workers-1)
+    __builtin_ia32_pause();
+  write_checkpoint();
+  stopping = 0;
+  host_futex(&stopping, FUTEX_WAKE_PRIVATE, INT_MAX, 0);
+  while (parked)
+    __builtin_ia32_pause();
+}
+
+int sched_t::worker(void* arg)
+{
+  int w = (long)arg;
+  long since_report = 0;
+  pin_thread(w);
+  while (1) {
+    if (stopping || checkpoint_due())
+      stop_world();
+    if (timed_waiters)
+      expire_waiters();
+    int seq = work_seq;
+    hart_t* h = dequeue(w);
+    if (!h) {
+      __sync_fetch_and_add(&idle_workers, 1);
+      struct timespec ts = { 0, IDLE_WAIT_NS };
+      host_futex(&work_seq, FUTEX_WAIT_PRIVATE, seq, &ts);
+      __sync_fetch_and_sub(&idle_workers, 1);
+      continue;
+    }
+    h->_worker = w;
+    long before = h->executed();
+    h->interpreter(conf_quantum);
+    since_report += h->executed() - before;
+    if (since_report >= conf_stat*1000000L) {
+      status_report();
+      since_report = 0;
+    }
+    if (h->_suspend) {
+      h->_suspend = false;
+      if (h->sched_state == sched_exited)
+	continue;
+      if (__sync_bool_compare_and_swap(&h->sched_state, sched_blocking, sched_blocked))
+	continue;		// waker will enqueue it
+      h->sched_state = sched_running;
+    }
+    enqueue(w, h);
+  }
+  return 0;
+}
+
+void run_workers(hart_t* first)
+{
+  runq = new runq_t[conf_workers]();
+  for (hart_t* h=hart_t::list(); h; h=h->next())
+    sched_t::resume(h);	// more than first after restore_checkpoint()
+  for (long w=1; w<conf_workers; w++) {
+    char* stack = new char[WORKER_STACK_SIZE];
+    long flags = CLONE_VM|CLONE_FS|CLONE_FILES|CLONE_SIGHAND|CLONE_THREAD|CLONE_SYSVSEM;
+    dieif(clone(sched_t::worker, stack+WORKER_STACK_SIZE, flags, (void*)w) < 0, "Cannot create worker %ld", w);
+  }
+  sched_t::worker(0);
+}
@@ -0,0 +1,136 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "options.h"
+#include "uspike.h"
+#include "trace.h"
+
+option<>     conf_trace("trace",	0, "uspike.trc",		"Write binary trace of instructions and memory references");
+
+/*
+  Full buffers are queued for a writer thread, clone()d like guest
+  threads (see spinlock_t in uspike.h).  Producers wait when too many
+  buffers are queued.  A hart flushes its own partial buffer when it
+  calls exit.  Only the owning thread may touch a buffer, so at exit
+  the other harts, which may still be running, just stop recording and
+  lose their partial buffers, and the queue is drained.
+*/
+
+#define TRACE_QUEUED  64	/* buffers waiting before producers wait */
+#define WRITER_STACK_SIZE  (1<<16)
+
+#define futex(a, b, c)  syscall(SYS_futex, a, b, c, 0, 0, 0)
+
+static int trace_fd = -1;
+static spinlock_t trace_lock;
+volatile bool trace_closing;	// stop recording, process is exiting
+static trace_buffer_t* head;	// writer queue
+static trace_buffer_t* tail;
+static trace_buffer_t* spare;	// free list
+static volatile int queued;	// buffers not yet written
+static volatile int work_seq;	// bumped when a buffer is queued
+
+static trace_buffer_t* new_buffer()
+{
+  trace_lock.lock();
+  trace_buffer_t* b = spare;
+  if (b)
+    spare = b->next;
+  trace_lock.unlock();
+  return b ? b : new trace_buffer_t;
+}
+
+tracer_t::tracer_t(int n)
+{
+  core = n;
+  buf = new_buffer();
+  p = buf->data;
+  last_pc = last_addr = 0;
+}
+
+void tracer_t::flush()
+{
+  if (p == buf->data)
+    return;
+  int q;
+  while ((q=queued) >= TRACE_QUEUED)
+    futex(&queued, FUTEX_WAIT, q);
+  buf->chunk.core = core;
+  buf->chunk.bytes = p - buf->data;
+  buf->next = 0;
+  trace_lock.lock();
+  if (tail)
+    tail->next = buf;
+  else
+    head = buf;
+  tail = buf;
+  queued++;
+  trace_lock.unlock();
+  __sync_fetch_and_add(&work_seq, 1);
+  futex(&work_seq, FUTEX_WAKE, 1);
+  buf = new_buffer();
+  p = buf->data;
+  last_pc = last_addr = 0;
+}
+
+static int writer(void* arg)
+{
+  while (1) {
+    int seq = work_seq;
+    trace_lock.lock();
+    trace_buffer_t* b = head;
+    head = tail = 0;
+    trace_lock.unlock();
+    if (!b) {
+      futex(&work_seq, FUTEX_WAIT, seq);
+      continue;
+    }
+    while (b) {
+      trace_buffer_t* next = b->next;
+      long n = sizeof(trace_chunk_t) + b->chunk.bytes;
+      if (write(trace_fd, &b->chunk, n) != n) {
+	static const char msg[] = "Cannot write trace file\n";
+	write(2, msg, sizeof msg-1);
+	abort();
+      }
+      trace_lock.lock();
+      b->next = spare;
+      spare = b;
+      queued--;
+      trace_lock.unlock();
+      futex(&queued, FUTEX_WAKE, INT32_MAX);
+      b = next;
+    }
+  }
+  return 0;
+}
+
+// Left open for a flush already under way when trace_closing was set
+static void trace_close()
+{
+  trace_closing = true;
+  __sync_synchronize();
+  int q;
+  while ((q=queued) > 0)
+    futex(&queued, FUTEX_WAIT, q);
+}
+
+void trace_setup()
+{
+  trace_fd = open(conf_trace, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  dieif(trace_fd < 0, "Cannot create %s", (const char*)conf_trace);
+  dieif(write(trace_fd, TRACE_MAGIC, 8) != 8, "Cannot write %s", (const char*)conf_trace);
+  char* stack = new char[WRITER_STACK_SIZE];
+  long flags = CLONE_VM|CLONE_FS|CLONE_FILES|CLONE_SIGHAND|CLONE_THREAD|CLONE_SYSVSEM;
+  dieif(clone(writer, stack+WRITER_STACK_SIZE, flags, 0) < 0, "Cannot create trace writer");
+  atexit(trace_close);
+}
@@ -0,0 +1,182 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+/*
+  Binary trace of retired instructions and memory references, written
+  by uspike and caveat --trace and read back with trace_reader_t:
+
+    header   "cavatrc1"					8 bytes
+    chunk    core, bytes				8 bytes
+	     records of that core			bytes
+
+  Each hart fills its own buffer, which a background thread writes as
+  one chunk.  Chunks of one core are in execution order, those of
+  different cores are interleaved as their buffers fill.  Every chunk
+  starts with pc and address zero, then each record is a tag byte:
+
+    tag&3 == 0	instruction, tag>>2 is the zigzag halfword pc delta,
+		or 63 followed by that delta as a varint
+    tag&3 != 0	1=load 2=store 3=amo of 1<<(tag>>2&3) bytes, followed
+		by the zigzag address delta as a varint
+
+  A varint is 7 bits per byte, low order first, with the high bit set
+  if more bytes follow.  Memory references follow their instruction,
+  possibly in the next chunk of the same core.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define TRACE_MAGIC   "cavatrc1"
+#define TRACE_BUFFER  (1<<16)	/* bytes of records per chunk */
+#define TRACE_RECORD  11	/* longest record, tag and 10-byte varint */
+
+enum trace_kind_t { trace_insn, trace_load, trace_store, trace_amo };
+
+struct trace_chunk_t {
+  int32_t core;
+  int32_t bytes;		// of records following
+};
+
+struct trace_buffer_t {
+  trace_buffer_t* next;		// in writer queue or free list
+  trace_chunk_t chunk;		// written together with data
+  uint8_t data[TRACE_BUFFER];
+};
+
+extern volatile bool trace_closing;
+
+class tracer_t {		// one per hart
+  trace_buffer_t* buf;
+  uint8_t* p;			// next record
+  long last_pc;
+  long last_addr;
+  int core;
+  void varint(uint64_t v) { while (v >= 0x80) { *p++ = v | 0x80; v >>= 7; } *p++ = v; }
+  static uint64_t zigzag(long v) { return (v << 1) ^ (v >> 63); }
+  bool room() {
+    if (trace_closing)
+      return false;
+    if (p > buf->data+TRACE_BUFFER-TRACE_RECORD)
+      flush();
+    return true;
+  }
+public:
+  tracer_t(int n);
+  void flush();			// hand buffer to writer thread
+  void insn(long pc) {
+    if (!room())
+      return;
+    uint64_t d = zigzag((pc-last_pc) >> 1);
+    last_pc = pc;
+    if (d < 63)
+      *p++ = d << 2;
+    else {
+      *p++ = 63 << 2;
+      varint(d);
+    }
+  }
+  void ref(trace_kind_t k, long a, int size) {
+    if (!room())
+      return;
+    *p++ = k | (__builtin_ctz(size) & 3) << 2;
+    varint(zigzag(a-last_addr));
+    last_addr = a;
+  }
+};
+
+void trace_setup();		// open --trace file, start writer thread
+
+/*
+  Reader, needs only this header.  A trace is read from memory, for
+  example mapped by trace_map(), and records come out in file order.
+*/
+
+struct trace_rec_t {
+  int kind;			// trace_kind_t
+  int core;
+  int size;			// bytes, 0 for instructions
+  long addr;			// pc for instructions
+};
+
+class trace_reader_t {
+  const uint8_t* p;
+  const uint8_t* end;		// of trace
+  const uint8_t* chunk_end;
+  int core;
+  long pc;
+  long addr;
+  uint64_t varint() {
+    uint64_t v = 0;
+    for (int shift=0; p < chunk_end; shift+=7) {
+      uint8_t b = *p++;
+      v |= uint64_t(b & 0x7f) << shift;
+      if (!(b & 0x80))
+	break;
+    }
+    return v;
+  }
+  static long unzigzag(uint64_t v) { return (v >> 1) ^ -(v & 1); }
+public:
+  trace_reader_t(const void* trace, long bytes) {
+    p = (const uint8_t*)trace;
+    end = p + bytes;
+    if (bytes < 8 || memcmp(p, TRACE_MAGIC, 8) != 0)
+      p = end;			// valid() is false
+    else
+      p += 8;
+    chunk_end = p;
+  }
+  bool valid() { return p < end; }
+  bool next(trace_rec_t& r) {
+    while (p == chunk_end) {
+      trace_chunk_t c;
+      if (end-p < (long)sizeof c)
+	return false;
+      memcpy(&c, p, sizeof c);
+      p += sizeof c;
+      core = c.core;
+      chunk_end = c.bytes <= end-p ? p+c.bytes : end; // truncated file
+      pc = addr = 0;
+    }
+    uint8_t tag = *p++;
+    r.core = core;
+    r.kind = tag & 3;
+    if (r.kind == trace_insn) {
+      uint64_t d = tag >> 2;
+      if (d == 63)
+	d = varint();
+      pc += unzigzag(d) << 1;
+      r.addr = pc;
+      r.size = 0;
+    }
+    else {
+      addr += unzigzag(varint());
+      r.addr = addr;
+      r.size = 1 << (tag>>2 & 3);
+    }
+    return true;
+  }
+};
+
+// Map trace file read-only, returns 0 if it cannot
+static inline const void* trace_map(const char* fname, long* bytes)
+{
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  struct stat st;
+  void* m = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+    m = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED)
+    return 0;
+  *bytes = st.st_size;
+  return m;
+}
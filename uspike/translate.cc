@@ -0,0 +1,364 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <typeinfo>
+
+#include "options.h"
+#include "uspike.h"
+#include "instructions.h"
+#include "mmu.h"
+#include "hart.h"
+#include "fpfast.h"
+
+option<long> conf_jit("jit",	0, 1000,			"Translate blocks to x86-64 after N executions");
+
+/*
+  Hot basic blocks are translated into x86-64 code which keeps the
+  RISC-V register file in memory:  rbx points to xpr[], r12 holds the
+  hart_t* and r13 the instruction count seen by the last instruction.
+  Each instruction is computed in rax/rcx.  Loads and stores touch host
+  memory directly only when the hart has no memory model, otherwise
+  they (and everything else uncommon) call the golden[] handlers, so
+  load_model() and store_model() still run.  insn_model() and
+  jump_model() are called through helpers under the same condition.
+  Translated code returns the next pc.
+*/
+
+#define CODE_CACHE_SIZE  (1L<<26)	/* bytes of translated code */
+#define MAX_X86_INSN     128		/* bytes per RISC-V instruction */
+
+static uint8_t* volatile code_cache;
+static volatile long cache_used;
+
+extern long (*golden[])(long pc, mmu_t& MMU, class processor_t* p);
+
+static void jit_model(hart_t* cpu, long pc)            { cpu->mmu()->insn_model(pc); }
+static long jit_jump(hart_t* cpu, long npc, long pc)   { return cpu->mmu()->jump_model(npc, pc); }
+static long jit_golden(hart_t* cpu, long pc, long op)  { return golden[op](pc, *cpu->mmu(), cpu->spike()); }
+static long jit_csr(hart_t* cpu, long pc, long op)     { fp_sync(cpu->spike()); return jit_golden(cpu, pc, op); }
+static void jit_roi(hart_t* cpu, long pc, long what)   { cpu->mmu()->roi_model(what, pc); }
+static long jit_ecall(hart_t* cpu, long pc, long insns) { cpu->write_pc(pc); cpu->proxy_ecall(insns); return pc+4; }
+
+enum { RAX=0, RCX=1, RDX=2, RSI=6, RDI=7 };
+enum alu_t { ADD, SUB, XOR, OR, AND, SLL, SRL, SRA, SLT, SLTU, MUL, ADDW, SUBW, SLLW, SRLW, SRAW };
+
+class x86_t {			// x86-64 machine code emitter
+  uint8_t* p;
+public:
+  x86_t(uint8_t* buf) { p=buf; }
+  uint8_t* here() { return p; }
+  void b(int v) { *p++ = v; }
+  void b(int v1, int v2) { b(v1); b(v2); }
+  void b(int v1, int v2, int v3) { b(v1); b(v2); b(v3); }
+  void d(int32_t v) { memcpy(p, &v, 4); p+=4; }
+  void q(long v) { memcpy(p, &v, 8); p+=8; }
+
+  void ldx(int r, int rn) { b(0x48, 0x8B, 0x83|r<<3); d(rn*8); } // mov r, xpr[rn]
+  void stx(int rn, int r) { if (rn > 0) { b(0x48, 0x89, 0x83|r<<3); d(rn*8); } }
+  void movi(int r, long v) {
+    if (v == (int32_t)v) { b(0x48, 0xC7, 0xC0|r); d(v); }
+    else                 { b(0x48, 0xB8|r);       q(v); }
+  }
+  void alu(alu_t op);		// rax = rax op rcx
+  void call(void* fn) { movi(RAX, (long)fn); b(0xFF, 0xD0); }
+  void helper(void* fn, long a1, long a2) { b(0x4C, 0x89, 0xE7); movi(RSI, a1); movi(RDX, a2); call(fn); }
+  uint8_t* jcc(int cc) { b(0x0F, cc); d(0); return p; } // returns end of rel32 to patch
+  uint8_t* jmp()       { b(0xE9);     d(0); return p; }
+  void patch(uint8_t* end) { int32_t rel = p-end; memcpy(end-4, &rel, 4); }
+};
+
+void x86_t::alu(alu_t op)
+{
+  switch (op) {
+  case ADD:   b(0x48, 0x01, 0xC8);  break;
+  case SUB:   b(0x48, 0x29, 0xC8);  break;
+  case XOR:   b(0x48, 0x31, 0xC8);  break;
+  case OR:    b(0x48, 0x09, 0xC8);  break;
+  case AND:   b(0x48, 0x21, 0xC8);  break;
+  case SLL:   b(0x48, 0xD3, 0xE0);  break;
+  case SRL:   b(0x48, 0xD3, 0xE8);  break;
+  case SRA:   b(0x48, 0xD3, 0xF8);  break;
+  case SLT:   b(0x48, 0x39, 0xC8);  b(0x0F, 0x9C, 0xC0);  b(0x48, 0x0F, 0xB6);  b(0xC0);  break;
+  case SLTU:  b(0x48, 0x39, 0xC8);  b(0x0F, 0x92, 0xC0);  b(0x48, 0x0F, 0xB6);  b(0xC0);  break;
+  case MUL:   b(0x48, 0x0F, 0xAF);  b(0xC1);  break;
+  case ADDW:  b(0x01, 0xC8);  b(0x48, 0x63, 0xC0);  break;
+  case SUBW:  b(0x29, 0xC8);  b(0x48, 0x63, 0xC0);  break;
+    // same as interpreter: uint32_t results are not sign extended
+  case SLLW:  b(0xD3, 0xE0);  break;
+  case SRLW:  b(0xD3, 0xE8);  break;
+  case SRAW:  b(0xD3, 0xF8);  b(0x48, 0x63, 0xC0);  break;
+  }
+}
+
+static void rrr(x86_t& x, Insn_t i, alu_t op)
+{
+  x.ldx(RAX, i.rs1());
+  x.ldx(RCX, i.rs2());
+  x.alu(op);
+  x.stx(i.rd(), RAX);
+}
+
+static void rri(x86_t& x, Insn_t i, alu_t op)
+{
+  x.ldx(RAX, i.rs1());
+  x.movi(RCX, i.immed());
+  x.alu(op);
+  x.stx(i.rd(), RAX);
+}
+
+static void load(x86_t& x, Insn_t i, int size, bool sign)
+{
+  x.ldx(RAX, i.rs1());
+  switch (size) {
+  case 1:  x.b(0x48, 0x0F, sign ? 0xBE : 0xB6);  break;
+  case 2:  x.b(0x48, 0x0F, sign ? 0xBF : 0xB7);  break;
+  case 4:  if (sign) x.b(0x48, 0x63); else x.b(0x8B);  break;
+  case 8:  x.b(0x48, 0x8B);  break;
+  }
+  x.b(0x80);			// [rax+disp32]
+  x.d(i.immed());
+  x.stx(i.rd(), RAX);
+}
+
+static void store(x86_t& x, Insn_t i, int size)
+{
+  x.ldx(RAX, i.rs1());
+  x.ldx(RCX, i.rs2());
+  switch (size) {
+  case 1:  x.b(0x88);  break;
+  case 2:  x.b(0x66, 0x89);  break;
+  case 4:  x.b(0x89);  break;
+  case 8:  x.b(0x48, 0x89);  break;
+  }
+  x.b(0x88);			// [rax+disp32], rcx
+  x.d(i.immed());
+}
+
+static void jump(x86_t& x, long pc, bool model) // rax = target, becomes next pc
+{
+  if (model) {
+    x.b(0x48, 0x89, 0xC6);	// mov rsi, rax
+    x.b(0x4C, 0x89, 0xE7);	// mov rdi, r12
+    x.movi(RDX, pc);
+    x.call((void*)jit_jump);
+  }
+}
+
+static void branch(x86_t& x, Insn_t i, long pc, int cc, bool model)
+{
+  x.ldx(RAX, i.rs1());
+  if (i.rs2() == NOREG)
+    x.b(0x31, 0xC9);		// xor ecx, ecx
+  else
+    x.ldx(RCX, i.rs2());
+  x.b(0x48, 0x39, 0xC8);	// cmp rax, rcx
+  uint8_t* taken = x.jcc(cc);
+  x.movi(RAX, pc + (i.compressed() ? 2 : 4));
+  uint8_t* done = x.jmp();
+  x.patch(taken);
+  x.movi(RAX, pc+i.immed());
+  jump(x, pc, model);
+  x.patch(done);
+}
+
+static void link(x86_t& x, Insn_t i, long pc, bool model)
+{
+  jump(x, pc, model);
+  if (i.rd() != NOREG) {
+    x.movi(RCX, pc + (i.compressed() ? 2 : 4));
+    x.stx(i.rd(), RCX);
+  }
+}
+
+// Emit code for one instruction, returns false if we cannot translate it.
+// Sets spike if the code calls a golden[] handler, which needs Spike
+// state to exist before the block starts because creating it moves xpr[].
+static bool emit(x86_t& x, Insn_t i, long pc, bool model, bool& spike)
+{
+  if (op_insns[i.opcode()] > 1) { // fused pair, translate both halves
+    if (!emit(x, decoder(code.image(pc), pc), pc, model, spike))
+      return false;
+    if (model)
+      x.helper((void*)jit_model, pc+4, 0);
+    return emit(x, code.at(pc+4), pc+4, model, spike);
+  }
+  switch (i.opcode()) {
+  case Op_c_addi4spn:
+  case Op_c_addi:
+  case Op_c_addi16sp:
+  case Op_addi:   rri(x, i, ADD);   return true;
+  case Op_c_addiw:
+  case Op_addiw:  rri(x, i, ADDW);  return true;
+  case Op_slti:   rri(x, i, SLT);   return true;
+  case Op_sltiu:  rri(x, i, SLTU);  return true;
+  case Op_xori:   rri(x, i, XOR);   return true;
+  case Op_ori:    rri(x, i, OR);    return true;
+  case Op_c_andi:
+  case Op_andi:   rri(x, i, AND);   return true;
+  case Op_c_slli:
+  case Op_slli:   rri(x, i, SLL);   return true;
+  case Op_c_srli:
+  case Op_srli:   rri(x, i, SRL);   return true;
+  case Op_c_srai:
+  case Op_srai:   rri(x, i, SRA);   return true;
+  case Op_slliw:  rri(x, i, SLLW);  return true;
+  case Op_srliw:  rri(x, i, SRLW);  return true;
+  case Op_sraiw:  rri(x, i, SRAW);  return true;
+
+  case Op_c_add:
+  case Op_add:    rrr(x, i, ADD);   return true;
+  case Op_sub:    rrr(x, i, SUB);   return true;
+  case Op_sll:    rrr(x, i, SLL);   return true;
+  case Op_slt:    rrr(x, i, SLT);   return true;
+  case Op_sltu:   rrr(x, i, SLTU);  return true;
+  case Op_xor:    rrr(x, i, XOR);   return true;
+  case Op_srl:    rrr(x, i, SRL);   return true;
+  case Op_sra:    rrr(x, i, SRA);   return true;
+  case Op_or:     rrr(x, i, OR);    return true;
+  case Op_and:    rrr(x, i, AND);   return true;
+  case Op_mul:    rrr(x, i, MUL);   return true;
+  case Op_c_addw:
+  case Op_addw:   rrr(x, i, ADDW);  return true;
+  case Op_c_subw:
+  case Op_subw:   rrr(x, i, SUBW);  return true;
+  case Op_sllw:   rrr(x, i, SLLW);  return true;
+  case Op_srlw:   rrr(x, i, SRLW);  return true;
+  case Op_sraw:   rrr(x, i, SRAW);  return true;
+
+  case Op_c_li:
+  case Op_c_lui:
+  case Op_lui:    x.movi(RAX, i.immed());     x.stx(i.rd(), RAX);  return true;
+  case Op_auipc:  x.movi(RAX, pc+i.immed());  x.stx(i.rd(), RAX);  return true;
+  case Op_c_mv:   x.ldx(RAX, i.rs2());        x.stx(i.rd(), RAX);  return true;
+
+  case Op_beq:    branch(x, i, pc, 0x84, model);  return true;
+  case Op_c_beqz: branch(x, i, pc, 0x84, model);  return true;
+  case Op_bne:    branch(x, i, pc, 0x85, model);  return true;
+  case Op_c_bnez: branch(x, i, pc, 0x85, model);  return true;
+  case Op_blt:    branch(x, i, pc, 0x8C, model);  return true;
+  case Op_bge:    branch(x, i, pc, 0x8D, model);  return true;
+  case Op_bltu:   branch(x, i, pc, 0x82, model);  return true;
+  case Op_bgeu:   branch(x, i, pc, 0x83, model);  return true;
+
+  case Op_c_j:
+  case Op_jal:
+    x.movi(RAX, pc+i.immed());
+    link(x, i, pc, model);
+    return true;
+  case Op_jalr:
+    x.ldx(RAX, i.rs1());
+    x.b(0x48, 0x05);  x.d(i.immed()); // add rax, imm32
+    x.b(0x48, 0x83, 0xE0);  x.b(0xFE); // and rax, ~1
+    link(x, i, pc, model);
+    return true;
+  case Op_c_jr:
+  case Op_c_jalr:
+    x.ldx(RAX, i.rs1());
+    link(x, i, pc, model);
+    return true;
+
+  case Op_ecall:
+    x.b(0x4C, 0x89, 0xE7);	// mov rdi, r12
+    x.movi(RSI, pc);
+    x.b(0x4C, 0x89, 0xEA);	// mov rdx, r13
+    x.call((void*)jit_ecall);
+    return true;
+
+  case Op_roi:
+    x.helper((void*)jit_roi, pc, i.immed());
+    return true;
+
+  case Op_csrrw:
+  case Op_csrrs:
+  case Op_csrrc:
+  case Op_csrrwi:
+  case Op_csrrsi:
+  case Op_csrrci:
+    x.helper((void*)jit_csr, pc, i.opcode());	// fflags may be pending in MXCSR
+    spike = true;
+    return true;
+
+  case Op_ebreak:
+  case Op_c_ebreak:
+    return false;		// trap_breakpoint cannot unwind translated code
+  }
+  if (!model) {
+    switch (i.opcode()) {
+    case Op_lb:     load(x, i, 1, true );  return true;
+    case Op_lbu:    load(x, i, 1, false);  return true;
+    case Op_lh:     load(x, i, 2, true );  return true;
+    case Op_lhu:    load(x, i, 2, false);  return true;
+    case Op_c_lw:
+    case Op_c_lwsp:
+    case Op_lw:     load(x, i, 4, true );  return true;
+    case Op_lwu:    load(x, i, 4, false);  return true;
+    case Op_c_ld:
+    case Op_c_ldsp:
+    case Op_ld:     load(x, i, 8, true );  return true;
+    case Op_sb:     store(x, i, 1);  return true;
+    case Op_sh:     store(x, i, 2);  return true;
+    case Op_c_sw:
+    case Op_c_swsp:
+    case Op_sw:     store(x, i, 4);  return true;
+    case Op_c_sd:
+    case Op_c_sdsp:
+    case Op_sd:     store(x, i, 8);  return true;
+    }
+  }
+  if (!golden[i.opcode()])
+    return false;
+  x.helper((void*)jit_golden, pc, i.opcode());
+  spike = true;
+  return true;
+}
+
+void translate(long pc, block_t* b, hart_t* cpu)
+{
+  if (!code_cache) {
+    void* m = mmap(0, CODE_CACHE_SIZE, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    dieif(m==MAP_FAILED, "Cannot mmap code cache");
+    if (!__sync_bool_compare_and_swap(&code_cache, 0, (uint8_t*)m))
+      munmap(m, CODE_CACHE_SIZE);
+  }
+  bool model = typeid(*cpu->mmu()) != typeid(mmu_t);
+  uint8_t buf[MAX_BLOCK*MAX_X86_INSN + 32];
+  x86_t x(buf);
+  x.b(0x53);			// push rbx
+  x.b(0x41, 0x54);		// push r12
+  x.b(0x41, 0x55);		// push r13
+  x.b(0x48, 0x89, 0xFB);	// mov rbx, rdi
+  x.b(0x49, 0x89, 0xF4);	// mov r12, rsi
+  x.b(0x49, 0x89, 0xD5);	// mov r13, rdx
+  Insn_t i;
+  bool spike = false;
+  for (long k=0; k<b->length; k++) {
+    i = b->insn[k].insn;
+    if (model)
+      x.helper((void*)jit_model, pc, 0);
+    if (!emit(x, i, pc, model, spike))
+      return;			// leave block to interpreter
+    pc += op_length[i.opcode()];
+  }
+  if (!op_ends_block[i.opcode()])
+    x.movi(RAX, pc);		// fell off end of block
+  x.b(0x41, 0x5D);		// pop r13
+  x.b(0x41, 0x5C);		// pop r12
+  x.b(0x5B);			// pop rbx
+  x.b(0xC3);			// ret
+  long size = (x.here()-buf + 15) & ~15L;
+  long offset;
+  do {
+    offset = cache_used;
+    if (offset+size > CODE_CACHE_SIZE)
+      return;			// code cache full
+  } while (!__sync_bool_compare_and_swap(&cache_used, offset, offset+size));
+  memcpy(code_cache+offset, buf, x.here()-buf);
+  if (spike)
+    b->uses_spike = true;
+  __sync_bool_compare_and_swap(&b->native, 0, (native_t)(code_cache+offset));
+}
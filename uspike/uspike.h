@@ -17,6 +17,15 @@
 #define diesegv()  (*(char*)0=1)
 #define checkif(bad) if (!(bad)) diesegv()
 
+// Guest threads are clone()d without TLS, so they cannot use pthread
+// mutexes, stdio, glibc malloc or __thread variables.  Threads of the
+// simulator that run alongside them are clone()d the same way.
+struct spinlock_t {
+  volatile int word;
+  void lock()   { while (__sync_lock_test_and_set(&word, 1)) __builtin_ia32_pause(); }
+  void unlock() { __sync_lock_release(&word); }
+};
+
 extern "C" {
   long load_elf_binary(const char* file_name, int include_data);
   int elf_find_symbol(const char* name, long* begin, long* end);
@@ -25,6 +34,10 @@ extern "C" {
   long emulate_brk(long addr);
   extern unsigned long low_bound, high_bound;
   void redecode(long pc);
+  int insert_breakpoint(long pc);
+  int remove_breakpoint(long pc);
+  void guest_mapped(long lo, long len);
+  void guest_unmapped(long lo, long len);
 };
 
 extern option<>     conf_isa;
@@ -32,11 +45,22 @@ extern option<>     conf_vec;
 extern option<long> conf_stat;
 extern option<bool> conf_ecall;
 extern option<bool> conf_quiet;
+extern option<long> conf_jit;
+extern option<bool> conf_blocks;
+extern option<int>  conf_workers;
 //extern option<long> conf_show;
 //extern option<>     conf_gdb;
 
 void status_report();
+int pin_thread(int n);		// to nth of --cpus, returns NUMA node if --numa else -1
+void numa_move(const volatile void* addr, long bytes, int node);
+void* page_alloc(long bytes);	// whole pages, so numa_move() moves nothing else
 class hart_t* initial_cpu(long entry, long sp);
+void checkpoint_setup(class hart_t* first);	// restores if --restore
+bool checkpoint_due();
+long checkpoint_quantum(long how_many);	// to stop at --ckpt_at
+void checkpoint_poll();		// with one hart, between quanta
+void write_checkpoint();	// all harts stopped
 void show_insn(long pc, int tid);
 
 static inline bool find_symbol(const char* name, long &begin, long &end) { return elf_find_symbol(name, &begin, &end) != 0; }
@@ -0,0 +1,422 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <limits>
+#include <typeinfo>
+#include <type_traits>
+
+#include "options.h"
+#include "uspike.h"
+#include "instructions.h"
+#include "mmu.h"
+#include "hart.h"
+#include "spike_link.h"
+#include "vecfast.h"
+
+/*
+  Spike keeps a register group contiguous in its vector register file,
+  so every instruction is a single loop over vl elements whatever LMUL
+  is.  Kernels are templates instantiated for each SEW, and each one is
+  compiled for AVX-512, AVX2 and baseline x86-64, the loader picking
+  the best for the host.  This file is compiled without -ffast-math
+  (see Makefile):  floating point requires dynamic rounding mode RNE,
+  exception flags accumulate in MXCSR as in fpfast.cc, and NaN results
+  become the canonical NaN.  Masked instructions leave inactive elements
+  undisturbed, as does Spike.  Memory accesses run on the host only when
+  no memory model is attached, otherwise golden[] shows each element to
+  the model.
+*/
+
+extern long (*golden[])(long pc, mmu_t& MMU, class processor_t* p);
+
+#define KERNEL  __attribute__((target_clones("arch=skylake-avx512", "arch=haswell", "default")))
+
+#define GOLDEN  { golden[i.opcode()](pc, MMU, p); return; }
+
+static inline bool active(const uint8_t* m, long k) { return m[k>>3]>>(k&7) & 1; }
+
+template<class T> static inline T canon(T r) { return r==r ? r : std::numeric_limits<T>::quiet_NaN(); }
+
+//  Element operations, a is from vs2 and b from vs1, rs1 or immediate
+
+template<class T> using S = typename std::make_signed<T>::type;
+template<class T> static inline int shamt(T b) { return b & (8*sizeof(T)-1); }
+
+struct Add  { template<class T> T operator()(T a, T b) const { return a + b; } };
+struct Sub  { template<class T> T operator()(T a, T b) const { return a - b; } };
+struct Rsub { template<class T> T operator()(T a, T b) const { return b - a; } };
+struct And  { template<class T> T operator()(T a, T b) const { return a & b; } };
+struct Or   { template<class T> T operator()(T a, T b) const { return a | b; } };
+struct Xor  { template<class T> T operator()(T a, T b) const { return a ^ b; } };
+struct Sll  { template<class T> T operator()(T a, T b) const { return a << shamt(b); } };
+struct Srl  { template<class T> T operator()(T a, T b) const { return a >> shamt(b); } };
+struct Sra  { template<class T> T operator()(T a, T b) const { return S<T>(a) >> shamt(b); } };
+struct Mul  { template<class T> T operator()(T a, T b) const { return uint64_t(a) * uint64_t(b); } };
+struct Minu { template<class T> T operator()(T a, T b) const { return a<b ? a : b; } };
+struct Maxu { template<class T> T operator()(T a, T b) const { return a>b ? a : b; } };
+struct Min  { template<class T> T operator()(T a, T b) const { return S<T>(a)<S<T>(b) ? a : b; } };
+struct Max  { template<class T> T operator()(T a, T b) const { return S<T>(a)>S<T>(b) ? a : b; } };
+struct Mv   { template<class T> T operator()(T a, T b) const { return b; } };
+
+struct Fadd  { template<class T> T operator()(T a, T b) const { return canon(a + b); } };
+struct Fsub  { template<class T> T operator()(T a, T b) const { return canon(a - b); } };
+struct Frsub { template<class T> T operator()(T a, T b) const { return canon(b - a); } };
+struct Fmul  { template<class T> T operator()(T a, T b) const { return canon(a * b); } };
+struct Fdiv  { template<class T> T operator()(T a, T b) const { return canon(a / b); } };
+struct Frdiv { template<class T> T operator()(T a, T b) const { return canon(b / a); } };
+
+//  Kernels
+
+template<bool M, class T, class OP> KERNEL
+static void vv_kernel(T* vd, const T* vs2, const T* vs1, const uint8_t* m, long n)
+{
+  OP op;
+  for (long k=0; k<n; k++)
+    if (!M || active(m, k))
+      vd[k] = op(vs2[k], vs1[k]);
+}
+
+template<bool M, class T, class OP> KERNEL
+static void vx_kernel(T* vd, const T* vs2, T x, const uint8_t* m, long n)
+{
+  OP op;
+  for (long k=0; k<n; k++)
+    if (!M || active(m, k))
+      vd[k] = op(vs2[k], x);
+}
+
+template<bool M, class T, class OP> KERNEL
+static T reduce_kernel(T acc, const T* vs2, const uint8_t* m, long n)
+{
+  OP op;
+  for (long k=0; k<n; k++)
+    if (!M || active(m, k))
+      acc = op(acc, vs2[k]);
+  return acc;
+}
+
+template<bool M, class T> KERNEL
+static void fmacc_kernel(T* vd, const T* vs2, const T* vs1, const uint8_t* m, long n)
+{
+  for (long k=0; k<n; k++)
+    if (!M || active(m, k))
+      vd[k] = canon(fma(vs1[k], vs2[k], vd[k]));
+}
+
+template<bool M, class T> KERNEL
+static void fmacc_scalar_kernel(T* vd, const T* vs2, T x, const uint8_t* m, long n)
+{
+  for (long k=0; k<n; k++)
+    if (!M || active(m, k))
+      vd[k] = canon(fma(x, vs2[k], vd[k]));
+}
+
+template<class T> KERNEL
+static bool any_nan(const T* v, long n)
+{
+  bool nan = false;
+  for (long k=0; k<n; k++)
+    nan |= v[k] != v[k];
+  return nan;
+}
+
+template<bool M, class T> KERNEL
+static void load_kernel(T* vd, const char* a, long stride, const uint8_t* m, long n)
+{
+  for (long k=0; k<n; k++)
+    if (!M || active(m, k))
+      memcpy(&vd[k], a+k*stride, sizeof(T));
+}
+
+template<bool M, class T> KERNEL
+static void store_kernel(char* a, const T* vs3, long stride, const uint8_t* m, long n)
+{
+  for (long k=0; k<n; k++)
+    if (!M || active(m, k))
+      memcpy(a+k*stride, &vs3[k], sizeof(T));
+}
+
+//  Instruction level, returning false when golden[] must run instead
+
+enum form_t { VV, VX, VI, VIU, VF };
+
+// Register groups in regs must be aligned to LMUL, and a mask cannot
+// be overwritten.  Leave the illegal cases for golden[] to trap.
+static bool legal(processor_t* p, insn_t insn, long regs)
+{
+  vectorUnit_t& VU = p->VU;
+  if (VU.vill || VU.vstart != 0 || VU.vl == 0)
+    return false;
+  if (!insn.v_vm() && insn.rd() == 0)
+    return false;
+  return VU.vflmul <= 1 || (regs & (long(VU.vflmul)-1)) == 0;
+}
+
+// Only instantiated for integer SEW by .vf forms that never reach it
+template<class T> static T freg_value(processor_t* p, int r) { return 0; }
+template<> float freg_value<float>(processor_t* p, int r)
+{
+  float x;
+  uint32_t v = f32(READ_FREG(r)).v;
+  memcpy(&x, &v, sizeof x);
+  return x;
+}
+template<> double freg_value<double>(processor_t* p, int r)
+{
+  double x;
+  uint64_t v = f64(READ_FREG(r)).v;
+  memcpy(&x, &v, sizeof x);
+  return x;
+}
+
+template<class T, class OP, form_t F>
+static void arith(processor_t* p, insn_t insn)
+{
+  vectorUnit_t& VU = p->VU;
+  long n = VU.vl;
+  T* vd = &VU.elt<T>(insn.rd(), 0, true);
+  T* vs2 = &VU.elt<T>(insn.rs2(), 0);
+  const uint8_t* m = &VU.elt<uint8_t>(0, 0);
+  if (F == VV) {
+    T* vs1 = &VU.elt<T>(insn.rs1(), 0);
+    if (insn.v_vm())  vv_kernel<false, T, OP>(vd, vs2, vs1, m, n);
+    else              vv_kernel<true,  T, OP>(vd, vs2, vs1, m, n);
+    return;
+  }
+  T x;
+  if      (F == VX)   x = READ_REG(insn.rs1());
+  else if (F == VI)   x = insn.v_simm5();
+  else if (F == VIU)  x = insn.v_zimm5();
+  else                x = freg_value<T>(p, insn.rs1());
+  if (insn.v_vm())  vx_kernel<false, T, OP>(vd, vs2, x, m, n);
+  else              vx_kernel<true,  T, OP>(vd, vs2, x, m, n);
+}
+
+template<class OP, form_t F>
+static bool int_op(processor_t* p, insn_t insn)
+{
+  if (!legal(p, insn, insn.rd() | insn.rs2() | (F==VV ? insn.rs1() : 0)))
+    return false;
+  switch (p->VU.vsew) {
+  case 8:   arith<uint8_t,  OP, F>(p, insn);  return true;
+  case 16:  arith<uint16_t, OP, F>(p, insn);  return true;
+  case 32:  arith<uint32_t, OP, F>(p, insn);  return true;
+  case 64:  arith<uint64_t, OP, F>(p, insn);  return true;
+  }
+  return false;
+}
+
+template<class OP, form_t F>
+static bool fp_op(processor_t* p, insn_t insn)
+{
+  if (STATE.frm != 0 || !legal(p, insn, insn.rd() | insn.rs2() | (F==VV ? insn.rs1() : 0)))
+    return false;
+  switch (p->VU.vsew) {
+  case 32:  arith<float,  OP, F>(p, insn);  return true;
+  case 64:  arith<double, OP, F>(p, insn);  return true;
+  }
+  return false;
+}
+
+// Broadcast the NaN-unboxed bits of an FP register
+static bool fmv_v_f(processor_t* p, insn_t insn)
+{
+  if (!legal(p, insn, insn.rd()))
+    return false;
+  vectorUnit_t& VU = p->VU;
+  long n = VU.vl;
+  switch (VU.vsew) {
+  case 32:  { uint32_t* vd = &VU.elt<uint32_t>(insn.rd(), 0, true);
+      vx_kernel<false, uint32_t, Mv>(vd, vd, f32(READ_FREG(insn.rs1())).v, 0, n);  return true; }
+  case 64:  { uint64_t* vd = &VU.elt<uint64_t>(insn.rd(), 0, true);
+      vx_kernel<false, uint64_t, Mv>(vd, vd, f64(READ_FREG(insn.rs1())).v, 0, n);  return true; }
+  }
+  return false;
+}
+
+// Any NaN operand could raise invalid differently, so golden[] decides
+template<class T, form_t F>
+static bool fmacc(processor_t* p, insn_t insn)
+{
+  vectorUnit_t& VU = p->VU;
+  long n = VU.vl;
+  T* vd = &VU.elt<T>(insn.rd(), 0, true);
+  T* vs2 = &VU.elt<T>(insn.rs2(), 0);
+  const uint8_t* m = &VU.elt<uint8_t>(0, 0);
+  if (any_nan(vd, n) || any_nan(vs2, n))
+    return false;
+  if (F == VV) {
+    T* vs1 = &VU.elt<T>(insn.rs1(), 0);
+    if (any_nan(vs1, n))
+      return false;
+    if (insn.v_vm())  fmacc_kernel<false, T>(vd, vs2, vs1, m, n);
+    else              fmacc_kernel<true,  T>(vd, vs2, vs1, m, n);
+  }
+  else {
+    T x = freg_value<T>(p, insn.rs1());
+    if (x != x)
+      return false;
+    if (insn.v_vm())  fmacc_scalar_kernel<false, T>(vd, vs2, x, m, n);
+    else              fmacc_scalar_kernel<true,  T>(vd, vs2, x, m, n);
+  }
+  return true;
+}
+
+template<form_t F>
+static bool fmacc_op(processor_t* p, insn_t insn)
+{
+  if (STATE.frm != 0 || !legal(p, insn, insn.rd() | insn.rs2() | (F==VV ? insn.rs1() : 0)))
+    return false;
+  switch (p->VU.vsew) {
+  case 32:  return fmacc<float,  F>(p, insn);
+  case 64:  return fmacc<double, F>(p, insn);
+  }
+  return false;
+}
+
+// vd[0] = vs1[0] op vs2[*], vd and vs1 are single registers
+template<class T, class OP>
+static void reduce(processor_t* p, insn_t insn)
+{
+  vectorUnit_t& VU = p->VU;
+  long n = VU.vl;
+  const T* vs2 = &VU.elt<T>(insn.rs2(), 0);
+  const uint8_t* m = &VU.elt<uint8_t>(0, 0);
+  T acc = VU.elt<T>(insn.rs1(), 0);
+  if (insn.v_vm())  acc = reduce_kernel<false, T, OP>(acc, vs2, m, n);
+  else              acc = reduce_kernel<true,  T, OP>(acc, vs2, m, n);
+  VU.elt<T>(insn.rd(), 0, true) = acc;
+}
+
+template<class OP>
+static bool int_reduce(processor_t* p, insn_t insn)
+{
+  if (!legal(p, insn, insn.rs2()))
+    return false;
+  switch (p->VU.vsew) {
+  case 8:   reduce<uint8_t,  OP>(p, insn);  return true;
+  case 16:  reduce<uint16_t, OP>(p, insn);  return true;
+  case 32:  reduce<uint32_t, OP>(p, insn);  return true;
+  case 64:  reduce<uint64_t, OP>(p, insn);  return true;
+  }
+  return false;
+}
+
+// Spike sums in element order for both ordered and unordered
+// reductions, so there is no reassociation here either
+struct Fsum { template<class T> T operator()(T a, T b) const { return a + b; } };
+
+static bool fp_reduce(processor_t* p, insn_t insn)
+{
+  if (STATE.frm != 0 || !legal(p, insn, insn.rs2()))
+    return false;
+  vectorUnit_t& VU = p->VU;
+  switch (VU.vsew) {
+  case 32:  reduce<float,  Fsum>(p, insn);  VU.elt<float >(insn.rd(), 0, true) = canon(VU.elt<float >(insn.rd(), 0));  return true;
+  case 64:  reduce<double, Fsum>(p, insn);  VU.elt<double>(insn.rd(), 0, true) = canon(VU.elt<double>(insn.rd(), 0));  return true;
+  }
+  return false;
+}
+
+// Element width T comes from the instruction, so the register group
+// is EEW/SEW times LMUL.  Segment loads and stores are left to Spike.
+template<class T>
+static bool memory_legal(processor_t* p, insn_t insn, mmu_t& MMU)
+{
+  vectorUnit_t& VU = p->VU;
+  if (typeid(MMU) != typeid(mmu_t) || insn.v_nf() != 0)
+    return false;
+  if (VU.vill || VU.vstart != 0 || VU.vl == 0)
+    return false;
+  if (!insn.v_vm() && insn.rd() == 0)
+    return false;
+  float emul = VU.vflmul * 8*sizeof(T) / VU.vsew;
+  if (emul < 0.125 || emul > 8)
+    return false;
+  return emul <= 1 || (insn.rd() & (long(emul)-1)) == 0;
+}
+
+template<class T>
+static bool load(processor_t* p, insn_t insn, mmu_t& MMU, bool strided)
+{
+  if (!memory_legal<T>(p, insn, MMU))
+    return false;
+  vectorUnit_t& VU = p->VU;
+  long n = VU.vl;
+  T* vd = &VU.elt<T>(insn.rd(), 0, true);
+  const char* a = (const char*)READ_REG(insn.rs1());
+  long stride = strided ? READ_REG(insn.rs2()) : sizeof(T);
+  const uint8_t* m = &VU.elt<uint8_t>(0, 0);
+  if (insn.v_vm() && stride == sizeof(T))
+    memcpy(vd, a, n*sizeof(T));
+  else if (insn.v_vm())
+    load_kernel<false, T>(vd, a, stride, m, n);
+  else
+    load_kernel<true,  T>(vd, a, stride, m, n);
+  return true;
+}
+
+template<class T>
+static bool store(processor_t* p, insn_t insn, mmu_t& MMU, bool strided)
+{
+  if (!memory_legal<T>(p, insn, MMU))
+    return false;
+  vectorUnit_t& VU = p->VU;
+  long n = VU.vl;
+  const T* vs3 = &VU.elt<T>(insn.rd(), 0);
+  char* a = (char*)READ_REG(insn.rs1());
+  long stride = strided ? READ_REG(insn.rs2()) : sizeof(T);
+  const uint8_t* m = &VU.elt<uint8_t>(0, 0);
+  if (insn.v_vm() && stride == sizeof(T))
+    memcpy(a, vs3, n*sizeof(T));
+  else if (insn.v_vm())
+    store_kernel<false, T>(a, vs3, stride, m, n);
+  else
+    store_kernel<true,  T>(a, vs3, stride, m, n);
+  return true;
+}
+
+//  Instructions
+
+#define INT_OP(name, OP, F)	VEC_FAST(name) { if (!int_op<OP, F>(p, code.image(pc)))  GOLDEN; }
+#define FP_OP(name, OP, F)	VEC_FAST(name) { if (!fp_op<OP, F>(p, code.image(pc)))  GOLDEN; }
+#define REDUCE(name, OP)	VEC_FAST(name) { if (!int_reduce<OP>(p, code.image(pc)))  GOLDEN; }
+#define LOAD(name, T, s)	VEC_FAST(name) { if (!load<T>(p, code.image(pc), MMU, s))  GOLDEN; }
+#define STORE(name, T, s)	VEC_FAST(name) { if (!store<T>(p, code.image(pc), MMU, s))  GOLDEN; }
+
+INT_OP(vadd_vv,  Add,  VV)  INT_OP(vadd_vx,  Add,  VX)  INT_OP(vadd_vi,  Add,  VI)
+INT_OP(vsub_vv,  Sub,  VV)  INT_OP(vsub_vx,  Sub,  VX)
+INT_OP(vrsub_vx, Rsub, VX)  INT_OP(vrsub_vi, Rsub, VI)
+INT_OP(vand_vv,  And,  VV)  INT_OP(vand_vx,  And,  VX)  INT_OP(vand_vi,  And,  VI)
+INT_OP(vor_vv,   Or,   VV)  INT_OP(vor_vx,   Or,   VX)  INT_OP(vor_vi,   Or,   VI)
+INT_OP(vxor_vv,  Xor,  VV)  INT_OP(vxor_vx,  Xor,  VX)  INT_OP(vxor_vi,  Xor,  VI)
+INT_OP(vsll_vv,  Sll,  VV)  INT_OP(vsll_vx,  Sll,  VX)  INT_OP(vsll_vi,  Sll,  VIU)
+INT_OP(vsrl_vv,  Srl,  VV)  INT_OP(vsrl_vx,  Srl,  VX)  INT_OP(vsrl_vi,  Srl,  VIU)
+INT_OP(vsra_vv,  Sra,  VV)  INT_OP(vsra_vx,  Sra,  VX)  INT_OP(vsra_vi,  Sra,  VIU)
+INT_OP(vmul_vv,  Mul,  VV)  INT_OP(vmul_vx,  Mul,  VX)
+INT_OP(vminu_vv, Minu, VV)  INT_OP(vminu_vx, Minu, VX)
+INT_OP(vmin_vv,  Min,  VV)  INT_OP(vmin_vx,  Min,  VX)
+INT_OP(vmaxu_vv, Maxu, VV)  INT_OP(vmaxu_vx, Maxu, VX)
+INT_OP(vmax_vv,  Max,  VV)  INT_OP(vmax_vx,  Max,  VX)
+INT_OP(vmv_v_v,  Mv,   VV)  INT_OP(vmv_v_x,  Mv,   VX)  INT_OP(vmv_v_i,  Mv,   VI)
+VEC_FAST(vfmv_v_f) { if (!fmv_v_f(p, code.image(pc)))  GOLDEN; }
+
+REDUCE(vredsum_vs,  Add)   REDUCE(vredand_vs,  And)   REDUCE(vredor_vs,   Or)    REDUCE(vredxor_vs, Xor)
+REDUCE(vredminu_vs, Minu)  REDUCE(vredmin_vs,  Min)   REDUCE(vredmaxu_vs, Maxu)  REDUCE(vredmax_vs, Max)
+
+FP_OP(vfadd_vv, Fadd, VV)  FP_OP(vfadd_vf, Fadd, VF)
+FP_OP(vfsub_vv, Fsub, VV)  FP_OP(vfsub_vf, Fsub, VF)  FP_OP(vfrsub_vf, Frsub, VF)
+FP_OP(vfmul_vv, Fmul, VV)  FP_OP(vfmul_vf, Fmul, VF)
+FP_OP(vfdiv_vv, Fdiv, VV)  FP_OP(vfdiv_vf, Fdiv, VF)  FP_OP(vfrdiv_vf, Frdiv, VF)
+VEC_FAST(vfmacc_vv) { if (!fmacc_op<VV>(p, code.image(pc)))  GOLDEN; }
+VEC_FAST(vfmacc_vf) { if (!fmacc_op<VF>(p, code.image(pc)))  GOLDEN; }
+VEC_FAST(vfredosum_vs) { if (!fp_reduce(p, code.image(pc)))  GOLDEN; }
+VEC_FAST(vfredsum_vs)  { if (!fp_reduce(p, code.image(pc)))  GOLDEN; }
+
+LOAD(vle8_v,   uint8_t,  false)  LOAD(vle16_v,  uint16_t, false)  LOAD(vle32_v,  uint32_t, false)  LOAD(vle64_v,  uint64_t, false)
+STORE(vse8_v,  uint8_t,  false)  STORE(vse16_v, uint16_t, false)  STORE(vse32_v, uint32_t, false)  STORE(vse64_v, uint64_t, false)
+LOAD(vlse8_v,  uint8_t,  true)   LOAD(vlse16_v, uint16_t, true)   LOAD(vlse32_v, uint32_t, true)   LOAD(vlse64_v, uint64_t, true)
+STORE(vsse8_v, uint8_t,  true)   STORE(vsse16_v, uint16_t, true)  STORE(vsse32_v, uint32_t, true)  STORE(vsse64_v, uint64_t, true)
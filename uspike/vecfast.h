@@ -0,0 +1,35 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+// Vector instructions executed by host SIMD kernels when vstart is
+// zero and the instruction is legal, otherwise calling golden[].
+// Floating point results and flags follow the same rules as fpfast.h.
+
+#define VEC_FAST(name)  void V_##name(Insn_t i, long pc, mmu_t& MMU, class processor_t* p)
+
+VEC_FAST(vadd_vv);   VEC_FAST(vadd_vx);   VEC_FAST(vadd_vi);
+VEC_FAST(vsub_vv);   VEC_FAST(vsub_vx);   VEC_FAST(vrsub_vx);  VEC_FAST(vrsub_vi);
+VEC_FAST(vand_vv);   VEC_FAST(vand_vx);   VEC_FAST(vand_vi);
+VEC_FAST(vor_vv);    VEC_FAST(vor_vx);    VEC_FAST(vor_vi);
+VEC_FAST(vxor_vv);   VEC_FAST(vxor_vx);   VEC_FAST(vxor_vi);
+VEC_FAST(vsll_vv);   VEC_FAST(vsll_vx);   VEC_FAST(vsll_vi);
+VEC_FAST(vsrl_vv);   VEC_FAST(vsrl_vx);   VEC_FAST(vsrl_vi);
+VEC_FAST(vsra_vv);   VEC_FAST(vsra_vx);   VEC_FAST(vsra_vi);
+VEC_FAST(vmul_vv);   VEC_FAST(vmul_vx);
+VEC_FAST(vminu_vv);  VEC_FAST(vminu_vx);  VEC_FAST(vmin_vv);   VEC_FAST(vmin_vx);
+VEC_FAST(vmaxu_vv);  VEC_FAST(vmaxu_vx);  VEC_FAST(vmax_vv);   VEC_FAST(vmax_vx);
+VEC_FAST(vmv_v_v);   VEC_FAST(vmv_v_x);   VEC_FAST(vmv_v_i);   VEC_FAST(vfmv_v_f);
+
+VEC_FAST(vredsum_vs);  VEC_FAST(vredand_vs);  VEC_FAST(vredor_vs);   VEC_FAST(vredxor_vs);
+VEC_FAST(vredminu_vs); VEC_FAST(vredmin_vs);  VEC_FAST(vredmaxu_vs); VEC_FAST(vredmax_vs);
+
+VEC_FAST(vfadd_vv);  VEC_FAST(vfadd_vf);  VEC_FAST(vfsub_vv);  VEC_FAST(vfsub_vf);  VEC_FAST(vfrsub_vf);
+VEC_FAST(vfmul_vv);  VEC_FAST(vfmul_vf);  VEC_FAST(vfdiv_vv);  VEC_FAST(vfdiv_vf);  VEC_FAST(vfrdiv_vf);
+VEC_FAST(vfmacc_vv); VEC_FAST(vfmacc_vf);
+VEC_FAST(vfredosum_vs); VEC_FAST(vfredsum_vs);
+
+VEC_FAST(vle8_v);    VEC_FAST(vle16_v);   VEC_FAST(vle32_v);   VEC_FAST(vle64_v);
+VEC_FAST(vse8_v);    VEC_FAST(vse16_v);   VEC_FAST(vse32_v);   VEC_FAST(vse64_v);
+VEC_FAST(vlse8_v);   VEC_FAST(vlse16_v);  VEC_FAST(vlse32_v);  VEC_FAST(vlse64_v);
+VEC_FAST(vsse8_v);   VEC_FAST(vsse16_v);  VEC_FAST(vsse32_v);  VEC_FAST(vsse64_v);